@@ -0,0 +1,231 @@
+#!/bin/sh
+# End to end comparison of ccm, make and ninja on a generated C project:
+# N sources split over M executables, every source includes a shared header
+# and its group header. Each tool builds its own copy of the tree, timing
+#
+#     full    clean build
+#     noop    nothing changed, median of R runs
+#     touch   one source touched, rebuild of one object and one link
+#
+# usage: bench/e2e.sh [N] [M] [j] [R] > results.json
+# Tools not on PATH are reported as skipped. Progress goes to stderr.
+set -e
+cd "$(dirname "$0")/.."
+REPO=$(pwd)
+N=${1:-400}; M=${2:-8}; J=${3:-$(nproc)}; R=${4:-5}
+CC=${CC:-cc}
+CFLAGS="-O1 -Wall"
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+now() { date +%s%N; }
+ms() { echo $(( ($2 - $1) / 1000000 )); }
+
+# ---- project --------------------------------------------------------------
+gen() {
+    mkdir -p "$1/src"
+    cat > "$1/src/common.h" <<EOF
+#ifndef COMMON_H
+#define COMMON_H
+#define MIX(x) ((x) * 2654435761u ^ ((x) >> 13))
+#endif
+EOF
+    g=0
+    while [ $g -lt $M ]; do
+        {
+            echo "#include \"common.h\""
+            i=$g; while [ $i -lt $N ]; do
+                echo "unsigned g${g}_f$i(unsigned x);"
+                i=$((i + M))
+            done
+        } > "$1/src/g$g.h"
+        {
+            echo "#include <stdio.h>"
+            echo "#include \"g$g.h\""
+            echo "int main(void) {"
+            echo "    unsigned x = 1;"
+            i=$g; while [ $i -lt $N ]; do
+                echo "    x = g${g}_f$i(x);"
+                i=$((i + M))
+            done
+            printf '    printf("%%u\\n", x);\n'
+            echo "    return 0;"
+            echo "}"
+        } > "$1/src/g${g}_main.c"
+        g=$((g + 1))
+    done
+    i=0
+    while [ $i -lt $N ]; do
+        g=$((i % M))
+        cat > "$1/src/g${g}_f$i.c" <<EOF
+#include "g$g.h"
+static unsigned table[64];
+unsigned g${g}_f$i(unsigned x)
+{
+    for (unsigned k = 0; k < 64; ++k) table[k] = MIX(x + k);
+    for (unsigned k = 1; k < 64; ++k) x ^= table[k] + table[k - 1] * $i;
+    return x;
+}
+EOF
+        i=$((i + 1))
+    done
+}
+
+sources() { # group
+    echo "src/$1_main.c"
+    ls "src" | grep "^$1_f" | sed 's|^|src/|'
+}
+
+gen_make() {
+    (
+        cd "$1"
+        echo "CC = $CC"
+        echo "CFLAGS = $CFLAGS"
+        printf "all:"
+        g=0; while [ $g -lt $M ]; do printf " bin/g$g"; g=$((g + 1)); done
+        echo
+        g=0; while [ $g -lt $M ]; do
+            printf "bin/g$g:"
+            sources g$g | sed 's|^src/\(.*\)\.c$|obj/\1.o|' | tr '\n' ' '
+            echo
+            printf "\t@mkdir -p bin\n\t\$(CC) \$(CFLAGS) -o \$@ \$^\n"
+            g=$((g + 1))
+        done
+        printf "obj/%%.o: src/%%.c\n"
+        printf "\t@mkdir -p obj\n\t\$(CC) \$(CFLAGS) -MMD -MP -c -o \$@ \$<\n"
+        echo "-include \$(wildcard obj/*.d)"
+    ) > "$1/Makefile"
+}
+
+gen_ninja() {
+    (
+        cd "$1"
+        echo "cflags = $CFLAGS"
+        echo "rule cc"
+        echo "  command = $CC \$cflags -MMD -MF \$out.d -c -o \$out \$in"
+        echo "  depfile = \$out.d"
+        echo "  deps = gcc"
+        echo "rule link"
+        echo "  command = $CC \$cflags -o \$out \$in"
+        g=0; while [ $g -lt $M ]; do
+            objs=
+            for s in $(sources g$g); do
+                o=obj/$(basename "$s" .c).o
+                echo "build $o: cc $s"
+                objs="$objs $o"
+            done
+            echo "build bin/g$g: link$objs"
+            g=$((g + 1))
+        done
+    ) > "$1/build.ninja"
+}
+
+gen_ccm() {
+    cp "$REPO/ccm.h" "$1/ccm.h"
+    cat > "$1/ccm.c" <<EOF
+#define CCM_IMPLEMENTATION
+#include "ccm.h"
+
+int main(s32 argc, c8 **argv)
+{
+    ccm_bootstrap(argc, argv);
+    ccm_spec b = {
+        .compiler = "$CC",
+        .output_flag = "-o",
+        .arena = ccm_arena_init(CCM_ARENA_DEFAULT_CAP),
+        .common_opts = ccm_str8_array("-O1", "-Wall"),
+        .depfiles = true,
+        .objects = true,
+        .j = $J,
+    };
+    ccm_target *bins = ccm_arena_alloc(ccm_target, &b.arena, $M);
+    b.deps.items = ccm_arena_alloc(ccm_target *, &b.arena, $M);
+    b.deps.len = $M;
+    for (s32 g = 0; g < $M; ++g) {
+        s32 n = 1 + ($N - g + $M - 1) / $M;
+        c8 **srcs = ccm_arena_alloc(c8 *, &b.arena, n);
+        srcs[0] = ccm_fmt(&b.arena, "src/g%d_main.c", g);
+        for (s32 i = g, k = 1; i < $N; i += $M) {
+            srcs[k++] = ccm_fmt(&b.arena, "src/g%d_f%d.c", g, i);
+        }
+        bins[g] = (ccm_target){
+            .name = ccm_fmt(&b.arena, "bin/g%d", g),
+            .sources = { .len = n, .items = srcs },
+        };
+        b.deps.items[g] = &bins[g];
+    }
+    mkdir("bin", 0755);
+    ccm_spec_build(&b);
+    ccm_arena_deinit(&b.arena);
+}
+EOF
+    # built ahead with the bench compiler, so ccm_bootstrap only stats
+    (cd "$1" && $CC -O2 -include stdalign.h -o ccm ccm.c)
+}
+
+# ---- runs -----------------------------------------------------------------
+median() { sort -n | awk '{ a[NR] = $1 } END { print a[int((NR + 1) / 2)] }'; }
+
+bench() { # tool dir cmd...
+    tool=$1; dir=$2; shift 2
+    echo "e2e: $tool" >&2
+    cd "$dir"
+
+    t0=$(now); "$@" > /dev/null 2>&1; t1=$(now)
+    full=$(ms $t0 $t1)
+
+    noops=
+    k=0; while [ $k -lt $R ]; do
+        t0=$(now); "$@" > /dev/null 2>&1; t1=$(now)
+        noops="$noops $(ms $t0 $t1)"
+        k=$((k + 1))
+    done
+    noop=$(echo $noops | tr ' ' '\n' | median)
+
+    # ccm compares mtimes at second granularity
+    sleep 1
+    touch src/g0_f0.c
+    t0=$(now); "$@" > /dev/null 2>&1; t1=$(now)
+    touch=$(ms $t0 $t1)
+
+    for g in $(seq 0 $((M - 1))); do
+        [ -x bin/g$g ] || { echo "e2e: $tool did not build bin/g$g" >&2; exit 1; }
+    done
+    cd "$REPO"
+    printf '    {"tool": "%s", "full_ms": %d, "noop_ms": %d, "touch_ms": %d}\n' \
+        "$tool" "$full" "$noop" "$touch" >> "$OUT/results"
+}
+
+skip() {
+    echo "e2e: $1 not found, skipped" >&2
+    printf '    {"tool": "%s", "skipped": true}\n' "$1" >> "$OUT/results"
+}
+
+echo "e2e: generating $N sources, $M targets" >&2
+gen "$OUT/proto"
+
+cp -r "$OUT/proto" "$OUT/ccm"
+gen_ccm "$OUT/ccm"
+bench ccm "$OUT/ccm" ./ccm build
+
+if command -v make > /dev/null; then
+    cp -r "$OUT/proto" "$OUT/make"
+    gen_make "$OUT/make"
+    bench make "$OUT/make" make -j"$J"
+else
+    skip make
+fi
+
+if command -v ninja > /dev/null; then
+    cp -r "$OUT/proto" "$OUT/ninja"
+    gen_ninja "$OUT/ninja"
+    bench ninja "$OUT/ninja" ninja -j"$J"
+else
+    skip ninja
+fi
+
+printf '{"n": %d, "m": %d, "j": %d, "runs": %d, "cc": "%s",\n' $N $M $J $R "$CC"
+printf ' "commit": "%s",\n' "$(git rev-parse --short HEAD 2>/dev/null)"
+printf ' "results": [\n'
+sed '$! s/$/,/' "$OUT/results"
+printf ' ]\n}\n'
@@ -0,0 +1,163 @@
+/* Scheduler benchmark: synthetic target graphs run through ccm_proc_mgr_run
+ * with a fake executor, `sleep <duration>` (or `true` for 0 ms) instead of cc.
+ *
+ *     cc -O2 -o sched bench/sched.c
+ *     ./sched <chain|fan|diamond|random> [n] [j] [ms] [jitter ms] [seed] > /dev/null
+ *
+ * chain     every job waits on the previous one
+ * fan       one root, n - 2 independent jobs, one sink over all of them
+ * diamond   a stack of diamonds, root -> 8 jobs -> join -> 8 jobs -> ...
+ * random    up to 4 random deps among the previous 1000 jobs
+ *
+ * Reported: makespan against the ideal max(critical path, work / j), core
+ * utilization of the j lanes, driver cpu time per job and peak arena use.
+ */
+#define CCM_IMPLEMENTATION
+#include "../ccm.h"
+
+#include <sys/resource.h>
+
+#define DIAMOND_WIDTH 8
+#define RANDOM_WINDOW 1000
+#define RANDOM_MAXDEPS 4
+
+static ccm_target *targets;
+static s64        *durations;   /* ns, per target */
+
+static c8 **sched_command(ccm_spec *spec, ccm_target const *t)
+{
+    s64 ns = durations[t - targets];
+    c8 **cmd = ccm_arena_alloc(c8 *, &spec->arena, 3);
+    if (ns == 0) {
+        cmd[0] = "true";
+        cmd[1] = NULL;
+    } else {
+        cmd[0] = "sleep";
+        cmd[1] = ccm_fmt(&spec->arena, "%.6f", ns / 1e9);
+        cmd[2] = NULL;
+    }
+    return cmd;
+}
+
+static void add_dep(ccm_arena *arena, ccm_target *t, ccm_target *dep, s32 cap)
+{
+    if (t->deps.items == NULL) t->deps.items = ccm_arena_alloc(ccm_target *, arena, cap);
+    for (s32 i = 0; i < t->deps.len; ++i) {
+        if (t->deps.items[i] == dep) return;
+    }
+    t->deps.items[t->deps.len++] = dep;
+}
+
+static void build_graph(ccm_arena *arena, c8 const *shape, s32 n)
+{
+    if (strcmp(shape, "chain") == 0) {
+        for (s32 i = 1; i < n; ++i) add_dep(arena, &targets[i], &targets[i - 1], 1);
+    } else if (strcmp(shape, "fan") == 0) {
+        for (s32 i = 1; i < n - 1; ++i) add_dep(arena, &targets[i], &targets[0], 1);
+        for (s32 i = 1; i < n - 1; ++i) add_dep(arena, &targets[n - 1], &targets[i], n);
+    } else if (strcmp(shape, "diamond") == 0) {
+        /* joins sit at multiples of DIAMOND_WIDTH + 1 */
+        s32 join = 0;
+        for (s32 i = 1; i < n; ++i) {
+            if (i % (DIAMOND_WIDTH + 1) == 0) {
+                for (s32 j = join + 1; j < i; ++j) {
+                    add_dep(arena, &targets[i], &targets[j], DIAMOND_WIDTH);
+                }
+                join = i;
+            } else {
+                add_dep(arena, &targets[i], &targets[join], 1);
+            }
+        }
+    } else if (strcmp(shape, "random") == 0) {
+        for (s32 i = 1; i < n; ++i) {
+            s32 window = ccm_s32_min(i, RANDOM_WINDOW);
+            s32 ndeps = rand() % (RANDOM_MAXDEPS + 1);
+            for (s32 k = 0; k < ndeps; ++k) {
+                add_dep(arena, &targets[i], &targets[i - 1 - rand() % window], RANDOM_MAXDEPS);
+            }
+        }
+    } else {
+        fprintf(stderr, "unknown shape %s\n", shape);
+        exit(1);
+    }
+}
+
+static s64 cpu_ns(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ll
+         + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ll;
+}
+
+int main(s32 argc, c8 **argv)
+{
+    c8 const *shape = argc > 1 ? argv[1] : "random";
+    s32 n      = argc > 2 ? atoi(argv[2]) : 10000;
+    s32 j      = argc > 3 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+    f64 ms     = argc > 4 ? atof(argv[4]) : 0;
+    f64 jitter = argc > 5 ? atof(argv[5]) : 0;
+    srand(argc > 6 ? atoi(argv[6]) : 1);
+
+    ccm_spec spec = {
+        .output_flag = "-o",
+        .command = sched_command,
+        .arena = ccm_arena_init(CCM_ARENA_DEFAULT_CAP),
+        .j = j,
+    };
+
+    ccm_str8_array sources = ccm_str8_array("/dev/null");
+    targets   = ccm_arena_alloc(ccm_target, &spec.arena, n);
+    durations = ccm_arena_alloc(s64, &spec.arena, n);
+    spec.deps.items = ccm_arena_alloc(ccm_target *, &spec.arena, n);
+    spec.deps.len = n;
+
+    s64 work = 0;
+    for (s32 i = 0; i < n; ++i) {
+        targets[i] = (ccm_target){
+            .name = ccm_fmt(&spec.arena, "/nonexistent/ccm-sched/%d", i),
+            .sources = sources,
+        };
+        f64 d = ms + jitter * (2.0 * rand() / RAND_MAX - 1.0);
+        durations[i] = d > 0 ? d * 1e6 : 0;
+        work += durations[i];
+        spec.deps.items[i] = &targets[i];
+    }
+    build_graph(&spec.arena, shape, n);
+
+    /* deps always point backwards, index order is a topological order */
+    s64 *finish = malloc(n * sizeof(s64));
+    s64 critical = 0;
+    for (s32 i = 0; i < n; ++i) {
+        s64 start = 0;
+        for (s32 k = 0; k < targets[i].deps.len; ++k) {
+            s64 f = finish[targets[i].deps.items[k] - targets];
+            if (f > start) start = f;
+        }
+        finish[i] = start + durations[i];
+        if (finish[i] > critical) critical = finish[i];
+    }
+    free(finish);
+    s64 ideal = critical > work / j ? critical : work / j;
+    lll graph_bytes = ccm_arena_used(&spec.arena);
+
+    s64 cpu = cpu_ns();
+    s64 start = ccm_now_ns();
+    ccm_spec_build(&spec);
+    s64 makespan = ccm_now_ns() - start;
+    cpu = cpu_ns() - cpu;
+
+    s64 busy = 0;
+    for (s32 i = 0; i < n; ++i) busy += targets[i].end_ns - targets[i].start_ns;
+
+    fprintf(stderr,
+            "%-8s n=%d j=%d job=%.1f±%.1fms makespan=%.1fms ideal=%.1fms (x%.2f) "
+            "critical=%.1fms utilization=%.1f%% driver=%.1fus/job arena=%ldKiB\n",
+            shape, n, j, ms, jitter, makespan / 1e6, ideal / 1e6,
+            ideal ? (f64)makespan / ideal : 0, critical / 1e6,
+            100.0 * busy / ((f64)makespan * j), cpu / 1e3 / n,
+            (spec.arena.peak - graph_bytes) / 1024);
+
+    ccm_arena_deinit(&spec.arena);
+    return 0;
+}
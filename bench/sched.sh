@@ -0,0 +1,13 @@
+#!/bin/sh
+# Run every graph shape of bench/sched.c.
+# usage: bench/sched.sh [n] [j] [job ms] [jitter ms] [extra CFLAGS...]
+set -e
+cd "$(dirname "$0")/.."
+N=${1:-2000}; J=${2:-$(nproc)}; MS=${3:-2}; JITTER=${4:-1}
+[ $# -gt 4 ] && shift 4 || set --
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+${CC:-cc} -O2 -include stdalign.h "$@" -o "$OUT/sched" bench/sched.c
+for shape in chain fan diamond random; do
+    (cd "$OUT" && ./sched "$shape" "$N" "$J" "$MS" "$JITTER" > /dev/null)
+done
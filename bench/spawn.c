@@ -0,0 +1,68 @@
+/* Spawn overhead benchmark: builds a graph of `true` jobs, so the makespan is
+ * almost entirely ccm's own process handling. Build once per backend:
+ *
+ *     cc -O2 -DCCM_SPAWN=CCM_SPAWN_FORK -o spawn_fork bench/spawn.c
+ *     ./spawn_fork [njobs] [j] [ballast MB] > /dev/null
+ *
+ * The ballast is touched heap memory standing in for a big driver process
+ * (spec arena, ASan shadow), which is what makes fork() expensive.
+ */
+#define CCM_IMPLEMENTATION
+#include "../ccm.h"
+
+static c8 const *backend(void)
+{
+    switch (CCM_SPAWN) {
+    case CCM_SPAWN_FORK:  return "fork";
+    case CCM_SPAWN_POSIX: return "posix_spawn";
+    case CCM_SPAWN_CLONE: return "clone";
+    }
+    return "?";
+}
+
+int main(s32 argc, c8 **argv)
+{
+    s32 njobs   = argc > 1 ? atoi(argv[1]) : 1000;
+    s32 j       = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    lll ballast = argc > 3 ? atol(argv[3]) : 0;
+
+    c8 *mem = malloc(ballast << 20);
+    if (ballast) memset(mem, 1, ballast << 20);
+
+    ccm_spec spec = {
+        .compiler = "true",
+        .output_flag = "-o",
+        .arena = ccm_arena_init(CCM_ARENA_DEFAULT_CAP),
+        .j = j,
+    };
+
+    /* binary tree, every job waits on its parent */
+    ccm_str8_array sources = ccm_str8_array("/dev/null");
+    ccm_target *targets = ccm_arena_alloc(ccm_target, &spec.arena, njobs);
+    for (s32 i = 0; i < njobs; ++i) {
+        ccm_target *t = &targets[i];
+        *t = (ccm_target){
+            .name    = ccm_fmt(&spec.arena, "/nonexistent/ccm-bench/%d", i),
+            .sources = sources,
+        };
+        if (i > 0) {
+            t->deps.len = 1;
+            t->deps.items = ccm_arena_alloc(ccm_target *, &spec.arena, 1);
+            t->deps.items[0] = &targets[(i - 1) / 2];
+        }
+    }
+    spec.deps.len = njobs;
+    spec.deps.items = ccm_arena_alloc(ccm_target *, &spec.arena, njobs);
+    for (s32 i = 0; i < njobs; ++i) spec.deps.items[i] = &targets[i];
+
+    s64 start = ccm_now_ns();
+    ccm_spec_build(&spec);
+    s64 elapsed = ccm_now_ns() - start;
+
+    fprintf(stderr, "%-12s jobs=%d j=%d ballast=%ldMB total=%.1f ms per-job=%.1f us\n",
+            backend(), njobs, j, ballast, elapsed / 1e6, elapsed / 1e3 / njobs);
+
+    free(mem);
+    ccm_arena_deinit(&spec.arena);
+    return 0;
+}
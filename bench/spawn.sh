@@ -0,0 +1,13 @@
+#!/bin/sh
+# Compare the spawn backends of ccm_childproc_fork.
+# usage: bench/spawn.sh [njobs] [j] [ballast MB] [extra CFLAGS...]
+set -e
+cd "$(dirname "$0")/.."
+NJOBS=${1:-1000}; J=${2:-$(nproc)}; MB=${3:-0}
+[ $# -gt 3 ] && shift 3 || set --
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+for b in FORK POSIX CLONE; do
+    ${CC:-cc} -O2 -include stdalign.h "$@" -DCCM_SPAWN=CCM_SPAWN_$b -o "$OUT/spawn_$b" bench/spawn.c
+    (cd "$OUT" && ./spawn_$b "$NJOBS" "$J" "$MB" > /dev/null)
+done
@@ -5,9 +5,12 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <libgen.h>
 #include <limits.h>
-#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -15,7 +18,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -52,16 +68,42 @@ typedef struct ccm_str8_dynarray ccm_str8_dynarray;
 
 typedef struct ccm_target*       ccm_rbvalue_t;
 typedef struct ccm_ring_buffer   ccm_ring_buffer;
+typedef struct ccm_prio_queue    ccm_prio_queue;
 
 typedef enum   ccm_event         ccm_event;
-typedef struct pollfd            pollfd;
 typedef struct ccm_pipe          ccm_pipe;
 typedef struct ccm_childproc     ccm_childproc;
+typedef struct ccm_jobserver     ccm_jobserver;
+typedef struct ccm_pool          ccm_pool;
+typedef struct ccm_load          ccm_load;
 typedef struct ccm_proc_mgr      ccm_proc_mgr;
 
+typedef struct ccm_hmap          ccm_hmap;
+
+typedef struct ccm_path_stat     ccm_path_stat;
+typedef struct ccm_path_table    ccm_path_table;
+
+typedef struct ccm_deplog_entry  ccm_deplog_entry;
+typedef struct ccm_deplog        ccm_deplog;
+
+typedef struct ccm_db_header     ccm_db_header;
+typedef struct ccm_db_record     ccm_db_record;
+typedef struct ccm_db            ccm_db;
+
+typedef struct ccm_cache         ccm_cache;
+
+typedef struct ccm_trace_event   ccm_trace_event;
+typedef struct ccm_trace         ccm_trace;
+
+typedef struct ccm_manifest_header ccm_manifest_header;
+typedef struct ccm_manifest      ccm_manifest;
+
 typedef struct ccm_target        ccm_target;
 typedef struct ccm_target_array  ccm_target_array;
+typedef struct ccm_graph         ccm_graph;
 typedef struct ccm_spec          ccm_spec;
+typedef struct ccm_watch_node    ccm_watch_node;
+typedef struct ccm_watcher       ccm_watcher;
 
 
 // -----------------------------------------------------------------------------
@@ -139,28 +181,79 @@ void ccm_log(s32 l, c8 const *fmt, ...) CCM_ATTR_PRINTF(2, 3);
 // -----------------------------------------------------------------------------
 // [4] Arena
 // -----------------------------------------------------------------------------
+/* NOTE
+ * The default backend reserves `capacity` bytes of address space with
+ * mmap(PROT_NONE) and commits it CCM_ARENA_COMMIT_SIZE at a time, so a tiny
+ * build touches a few pages and a 100k target graph never runs out. Where the
+ * reservation fails (RLIMIT_AS, no overcommit), or with
+ * CCM_ARENA_BACKEND=CCM_ARENA_CHAIN, the arena is a chain of malloc'd blocks.
+ */
+enum {
+    CCM_ARENA_VM,
+    CCM_ARENA_CHAIN,
+};
+
+#ifndef CCM_ARENA_BACKEND
+#define CCM_ARENA_BACKEND CCM_ARENA_VM
+#endif /* CCM_ARENA_BACKEND */
+
 #ifndef CCM_ARENA_DEFAULT_CAP
-#define CCM_ARENA_DEFAULT_CAP (64 * 1024 * 1024) /* 64mb */
+#define CCM_ARENA_DEFAULT_CAP (64ll << 30) /* 64gb of address space */
 #endif /* CCM_ARENA_DEFAULT_CAP */
 
+#ifndef CCM_ARENA_COMMIT_SIZE
+#define CCM_ARENA_COMMIT_SIZE (256 * 1024)
+#endif /* CCM_ARENA_COMMIT_SIZE */
+
+#ifndef CCM_ARENA_BLOCK_SIZE
+#define CCM_ARENA_BLOCK_SIZE (1024 * 1024)
+#endif /* CCM_ARENA_BLOCK_SIZE */
+
 struct ccm_arena {
     u8 *memory;
     lll cap;
     lll off;
+    lll peak;                   /* high water mark of ccm_arena_used */
+    lll commit;                 /* vm: accessible prefix of memory */
+    lll base;                   /* chain: bytes used by the blocks before memory */
+    lll phase;                  /* ccm_arena_used at the last ccm_arena_phase */
+    s32 nblocks;
+    s32 backend;
 };
 
+/* chain: the head of every block, the state of the block before it */
+typedef struct ccm_arena_block {
+    u8 *prev;
+    lll cap;
+    lll off;
+    lll base;
+} ccm_arena_block;
+
+typedef struct ccm_arena_mark {
+    u8 *memory;
+    lll off;
+} ccm_arena_mark;
+
 ccm_arena ccm_arena_init(lll capacity);
 void *ccm_arena_allocarray(ccm_arena *arena, lll itemsize, lll itemcount, lll align);
+lll   ccm_arena_used(ccm_arena const *arena);
+ccm_arena_mark ccm_arena_save(ccm_arena const *arena);
+void  ccm_arena_rewind(ccm_arena *arena, ccm_arena_mark mark);
 void  ccm_arena_reset(ccm_arena *arena);
+void  ccm_arena_phase(ccm_arena *arena, c8 const *name);
 void  ccm_arena_log_stats(ccm_arena *arena);
 void  ccm_arena_deinit(ccm_arena *arena);
 
+/* NOTE
+ * Only the position is restored, blocks chained inside the scope are freed
+ * and committed pages stay committed for the next scope.
+ */
 #define ccm_lifetime(arena) as_scratch_arena(arena)
 #define ccm_as_scratch_arena(arena)                             \
-    for (ccm_arena _restore_arena = (arena),                    \
-             *_arena_ptr = &(arena);                            \
-         _arena_ptr != NULL;                                    \
-         *_arena_ptr = _restore_arena, _arena_ptr = NULL)
+    for (ccm_arena_mark _restore_mark = ccm_arena_save(&(arena)), \
+             *_mark_ptr = &_restore_mark;                       \
+         _mark_ptr != NULL;                                     \
+         ccm_arena_rewind(&(arena), _restore_mark), _mark_ptr = NULL)
 
 #define ccm_arena_type_align(t,a)   (t *)arena_allocarray(a, 0, 0, alignof(t))
 
@@ -193,7 +286,23 @@ ccm_rbvalue_t ccm_rb_pop(ccm_ring_buffer *rb);
 ccm_rbvalue_t ccm_rb_peek(ccm_ring_buffer const *rb);
 
 // -----------------------------------------------------------------------------
-// [6] Dynamic Array
+// [6] Priority Queue
+// -----------------------------------------------------------------------------
+/* binary max-heap of targets ordered by ccm_target_before */
+struct ccm_prio_queue {
+    s32 cap;
+    s32 len;
+    ccm_graph const *graph;
+    ccm_rbvalue_t *items;
+};
+
+ccm_prio_queue ccm_init_pq(ccm_arena *arena, ccm_graph const *graph, lll cap);
+void          ccm_pq_push(ccm_prio_queue *pq, ccm_rbvalue_t v);
+ccm_rbvalue_t ccm_pq_pop(ccm_prio_queue *pq);
+ccm_rbvalue_t ccm_pq_peek(ccm_prio_queue const *pq);
+
+// -----------------------------------------------------------------------------
+// [7] Dynamic Array
 // -----------------------------------------------------------------------------
 enum /* whether to memset with 0 or not */ {
     CCM_ZERO_MEM,
@@ -246,13 +355,13 @@ enum /* whether to memset with 0 or not */ {
 
 #define ccm_da_append(da, item)                                 \
     do {                                                        \
-        lll cap = (da)->cap;                                    \
-        lll len = (da)->len;                                    \
-        if (len == cap) {                                       \
-            cap = cap == 0 ? CCM_DA_INITIAL_CAP : cap * 2;      \
-            ccm_da_grow(da, cap);                               \
+        lll da_cap = (da)->cap;                                 \
+        lll da_len = (da)->len;                                 \
+        if (da_len == da_cap) {                                 \
+            da_cap = da_cap == 0 ? CCM_DA_INITIAL_CAP : da_cap * 2; \
+            ccm_da_grow(da, da_cap);                            \
         }                                                       \
-        (da)->items[len] = (item);                              \
+        (da)->items[da_len] = (item);                           \
         ++(da)->len;                                            \
     } while(0)
 
@@ -266,7 +375,22 @@ enum /* whether to memset with 0 or not */ {
     } while (0)
 
 // -----------------------------------------------------------------------------
-// [7] Strings
+// [8] Hash Map
+// -----------------------------------------------------------------------------
+/* open addressing u64 -> u32 map, key 0 is reserved for empty slots */
+struct ccm_hmap {
+    lll cap;
+    lll len;
+    u64 *keys;
+    u32 *vals;
+};
+
+bool ccm_hmap_get(ccm_hmap const *m, u64 key, u32 *val);
+void ccm_hmap_put(ccm_hmap *m, u64 key, u32 val);
+void ccm_hmap_deinit(ccm_hmap *m);
+
+// -----------------------------------------------------------------------------
+// [9] Strings
 // -----------------------------------------------------------------------------
 struct ccm_str8_buf {
     lll cap;
@@ -288,12 +412,52 @@ struct ccm_str8_dynarray {
 };
 
 // -----------------------------------------------------------------------------
-// [8] ChildProc
+// [10] ChildProc
 // -----------------------------------------------------------------------------
+/* the most output a job keeps in memory, the rest goes to its log */
 #ifndef CCM_CHILDPROC_REPORT_BUF_CAP
-#define CCM_CHILDPROC_REPORT_BUF_CAP (8*1024) /* 8kb */
+#define CCM_CHILDPROC_REPORT_BUF_CAP (64*1024) /* 64kb */
 #endif /* CCM_CHILDPROC_REPORT_BUF_CAP */
 
+#ifndef CCM_OUTPUT_LOG_DIR
+#define CCM_OUTPUT_LOG_DIR ".ccm/log"
+#endif /* CCM_OUTPUT_LOG_DIR */
+
+/* NOTE
+ * What happens to the output of a job, ccm_spec.output. No mode holds more
+ * than CCM_CHILDPROC_REPORT_BUF_CAP bytes of a job in memory. Past that,
+ * BUFFERED moves the output to CCM_OUTPUT_LOG_DIR/<target>.log and prints
+ * only its head.
+ *
+ * BUFFERED  printed in one piece when the job ends, jobs never interleave
+ * STREAM    printed as the lines come in, each prefixed with "[target] "
+ * LOG       spliced into the log without passing through ccm, printed only
+ *           when the job fails
+ */
+enum {
+    CCM_OUTPUT_BUFFERED,
+    CCM_OUTPUT_STREAM,
+    CCM_OUTPUT_LOG,
+};
+
+/* NOTE
+ * How ccm_childproc_fork starts a job. fork() copies the page tables of the
+ * driver, which gets expensive with a large arena mapped or under ASan.
+ * posix_spawn and clone(CLONE_VM|CLONE_VFORK) share the address space with
+ * the parent until exec, so their cost does not grow with the driver.
+ */
+#define CCM_SPAWN_FORK  0
+#define CCM_SPAWN_POSIX 1
+#define CCM_SPAWN_CLONE 2
+
+#ifndef CCM_SPAWN
+#define CCM_SPAWN CCM_SPAWN_POSIX
+#endif /* CCM_SPAWN */
+
+#ifndef CCM_CLONE_STACK_SIZE
+#define CCM_CLONE_STACK_SIZE (64*1024) /* 64kb */
+#endif /* CCM_CLONE_STACK_SIZE */
+
 enum ccm_event {
     CCM_EVENT_WAIT_ERROR   = 1 << 0,
     CCM_EVENT_WAIT_TERM    = 1 << 1,
@@ -306,42 +470,503 @@ enum ccm_event {
 
 };
 
+#ifndef CCM_EPOLL_MAX_EVENTS
+#define CCM_EPOLL_MAX_EVENTS 64
+#endif /* CCM_EPOLL_MAX_EVENTS */
+
+/* epoll_event.data of the SIGCHLD signalfd, children use (slot << 1 | is_pidfd) */
+#define CCM_EPOLL_SIGCHLD   UINT64_MAX
+#define CCM_EPOLL_JOBSERVER (UINT64_MAX - 1)
+#define CCM_EPOLL_INTERRUPT (UINT64_MAX - 2)
+
 struct ccm_pipe {
     s32 read;
     s32 write;
 };
 struct ccm_childproc {
-    pid_t pid;
+    pid_t pid;                  /* also the id of the job's process group */
+    bool running;               /* spawned and not reaped, pid may be signalled */
+    bool killed;                /* signalled by ccm_proc_mgr_stop */
+    s32 pidfd;
     s32 status;
-    clock_t time;
+    struct rusage usage;        /* filled by wait4 */
     ccm_pipe pipe;
+    s32 token;                  /* jobserver token held by this job */
+    bool cached;                /* restored from the compilation cache */
+    u64 cache_key;              /* primary cache key, 0 if not cacheable */
+    u64 inputs;
+    c8 *depfile;
 
     c8 **cmd;
+    s32 output;                 /* CCM_OUTPUT_* */
+    s32 log;                    /* CCM_OUTPUT_LOG_DIR/<target>.log, -1 until needed */
+    lll logged;                 /* bytes moved to the log */
     ccm_str8_buf report;
-    ccm_target const *target;
+    ccm_target *target;
+};
+
+/* NOTE
+ * GNU make jobserver. Every process owns one implicit job slot, each job past
+ * the first needs a token byte read from the jobserver, written back when the
+ * job is done. As a client ccm draws from the budget of a parent make or ccm
+ * named in MAKEFLAGS. As a server (ccm_spec.jobserver) it creates a pipe with
+ * j - 1 tokens and exports it in MAKEFLAGS, so nested make and
+ * gcc -flto=jobserver share one budget with ccm.
+ */
+enum /* ccm_jobserver_acquire */ {
+    CCM_JOBSERVER_IMPLICIT = -1,
+    CCM_JOBSERVER_WAIT     = -2,
+};
+struct ccm_jobserver {
+    s32  rfd;                   /* our own nonblocking open of the read side */
+    s32  wfd;
+    s32  pipe[2];               /* server only, inherited by the children */
+    bool fifo;                  /* wfd was opened by us */
+    bool implicit;              /* the implicit slot is free */
+    bool armed;                 /* rfd is polled for a token */
+    c8   *makeflags;            /* MAKEFLAGS to restore, server only */
+};
+
+ccm_jobserver ccm_jobserver_init(s32 j, bool serve);
+void ccm_jobserver_deinit(ccm_jobserver *js);
+bool ccm_jobserver_client(ccm_jobserver *js, c8 const *makeflags);
+bool ccm_jobserver_server(ccm_jobserver *js, s32 j);
+s32  ccm_jobserver_acquire(ccm_jobserver *js);
+void ccm_jobserver_release(ccm_jobserver *js, s32 token);
+
+/* NOTE
+ * Admission. A job takes ccm_target.slots of the spec->j slots and its
+ * expected memory from spec->mem_budget_kb, a pool additionally caps how many
+ * of its own targets run at once, like a ninja pool. A target whose pool is
+ * full is set aside and the next one in the ready queue gets its chance. A
+ * target that needs more slots or memory than are free holds the queue until
+ * enough jobs finished, or a stream of light jobs would starve the heavy link
+ * at its head. A job always starts when nothing else is running. Jobserver
+ * tokens stay one per job, slots only weigh in locally.
+ */
+struct ccm_pool {
+    c8  *name;
+    s32 depth;                  /* jobs of this pool at once, 0 is unlimited */
+    s32 nrunning;
+};
+
+#ifndef CCM_ADAPT_INTERVAL_MS
+#define CCM_ADAPT_INTERVAL_MS 1000 /* PSI averages over 10s, sampling faster only adds noise */
+#endif /* CCM_ADAPT_INTERVAL_MS */
+
+#ifndef CCM_PSI_MEMORY_HIGH
+#define CCM_PSI_MEMORY_HIGH 10.0  /* % of time some task stalled on memory */
+#endif /* CCM_PSI_MEMORY_HIGH */
+
+#ifndef CCM_PSI_CPU_HIGH
+#define CCM_PSI_CPU_HIGH 50.0     /* % of time some task waited for a cpu */
+#endif /* CCM_PSI_CPU_HIGH */
+
+#ifndef CCM_PSI_DIR
+#define CCM_PSI_DIR "/proc/pressure"
+#endif /* CCM_PSI_DIR */
+
+#ifndef CCM_LOADAVG_PATH
+#define CCM_LOADAVG_PATH "/proc/loadavg"
+#endif /* CCM_LOADAVG_PATH */
+
+/* NOTE
+ * Adaptive concurrency, ccm_spec.j = 0. The manager gets a slot for every
+ * cpu it may run on and admits up to `limit` jobs, which the run loop
+ * revisits every CCM_ADAPT_INTERVAL_MS. Memory stalls above
+ * CCM_PSI_MEMORY_HIGH halve the limit, cpu stalls above CCM_PSI_CPU_HIGH take
+ * one job off and a quiet machine gives one back. Kernels without PSI steer
+ * by the 1 minute load average less our own jobs instead, which lags behind,
+ * so it only ever moves one job at a time.
+ */
+struct ccm_load {
+    bool psi;                   /* memory and cpu are valid */
+    f64  memory;                /* "some avg10" of CCM_PSI_DIR/memory, % */
+    f64  cpu;                   /* "some avg10" of CCM_PSI_DIR/cpu, % */
+    f64  loadavg;               /* 1 minute, -1 if unknown */
 };
 
+s32      ccm_online_cpus(void);
+ccm_load ccm_load_sample(void);
+
+/* NOTE
+ * Failures. Every job leads its own process group, so stopping a job also
+ * stops whatever it spawned (make, lto workers, ...). A failed target never
+ * releases its dependents, they are skipped. ccm_spec.keep_going sets how
+ * many failures the build tolerates: at the last one the manager fails fast,
+ * admits nothing new and SIGTERMs the groups of the jobs in flight. 0 fails
+ * fast on the first failure, -1 never does and builds everything that does
+ * not depend on a failed target. Jobs are out of the terminal's foreground
+ * group, so SIGINT, SIGTERM and SIGHUP reach them through the manager, which
+ * forwards them, waits for the jobs and re-raises the signal.
+ */
+
+/* NOTE
+ * Children live in fixed slots, so a slot index is a stable name for a job
+ * that can go into epoll_event.data. Every job registers its output pipe and
+ * a pidfd, a child exiting wakes the loop right away and only the slots that
+ * got events are touched. Kernels without pidfd_open (< 5.3) fall back to a
+ * SIGCHLD signalfd followed by waitpid(-1, WNOHANG) until nothing is left.
+ */
 struct ccm_proc_mgr {
     s32           maxjobs;
+    s32           limit;        /* jobs admitted at once, maxjobs unless adaptive */
+    bool          adaptive;     /* ccm_spec.j = 0, see ccm_load */
+    s64           adapted_ns;   /* last ccm_proc_mgr_adapt sample */
     s32           nrunning;
+    s32           nfailed;      /* jobs of this run that failed */
+    s32           ninterrupted; /* jobs of this run killed by ccm_proc_mgr_stop */
+    s32           nskipped;     /* targets of this run that never got to run */
+    bool          stopping;     /* failing fast, nothing new is admitted */
+    s32           signal;       /* a forwarded SIGINT, SIGTERM or SIGHUP, 0 if none */
+    s32           intfd;        /* signalfd of the above */
+    s32           nslots;       /* slots taken by the running jobs, see ccm_target.slots */
+    lll           mem_kb;       /* expected memory of the running jobs */
     s32           timeout;
+    bool          history;
+    s32           epfd;
+    s32           sigfd;
+    s32           nfree;
+    s32           nready;
+    s32           *free;        /* stack of unused slots */
+    s32           *ready;       /* slots with events from the last ccm_proc_mgr_pub_ev */
+    sigset_t      sigmask;      /* the mask to restore, signalfd fallback only */
+    sigset_t      intmask;      /* SIGINT, SIGTERM and SIGHUP, unless ignored */
+    ccm_jobserver js;
+    ccm_prio_queue ready_queue;
+    ccm_target    **held;       /* ready targets set aside on a full pool */
     ccm_spec      *spec;
     ccm_event     *evs;
     ccm_childproc *cps;
-    pollfd        *pfds;
 };
 
 ccm_proc_mgr ccm_proc_mgr_init(ccm_spec *spec, s32 timeout);
+void ccm_proc_mgr_deinit(ccm_proc_mgr *pm);
+bool ccm_pool_full(ccm_pool const *p);
+bool ccm_proc_mgr_fits(ccm_proc_mgr const *pm, ccm_target const *t);
+bool ccm_proc_mgr_add_target(ccm_proc_mgr *pm, ccm_target *t);
+void ccm_proc_mgr_adapt(ccm_proc_mgr *pm);
+void ccm_proc_mgr_stop(ccm_proc_mgr *pm, s32 sig);
+void ccm_proc_mgr_pub_ev(ccm_proc_mgr *pm);
+s32  ccm_proc_mgr_run(ccm_proc_mgr *pm);
+s32  ccm_proc_mgr_run_active(ccm_proc_mgr *pm);
 
 
 bool ccm_childproc_fork(ccm_childproc *cp);
 void ccm_childproc_read(ccm_childproc *cp);
 s32  ccm_childproc_wait(ccm_childproc *cp);
 
+void ccm_childproc_log_path(ccm_childproc const *cp, c8 *path, lll size);
+bool ccm_childproc_log_open(ccm_childproc *cp);
+void ccm_childproc_spill(ccm_childproc *cp);
+void ccm_childproc_writev(ccm_childproc *cp, struct iovec *iov, s32 niov);
+void ccm_childproc_stream(ccm_childproc *cp, bool all);
+bool ccm_childproc_splice(ccm_childproc *cp);
 void ccm_childproc_report(ccm_childproc *cp);
 
 // -----------------------------------------------------------------------------
-// [9] Build Specification & Build Targets
+// [11] Path Table
+// -----------------------------------------------------------------------------
+#ifndef CCM_STAT_THREADS
+#define CCM_STAT_THREADS 16     /* stat is latency bound on network filesystems */
+#endif /* CCM_STAT_THREADS */
+
+#ifndef CCM_STAT_BATCH
+#define CCM_STAT_BATCH 64       /* paths a worker takes at once, fewer stay on the driver */
+#endif /* CCM_STAT_BATCH */
+
+enum /* ccm_path_stat.state */ {
+    CCM_PATH_UNKNOWN = 0,
+    CCM_PATH_QUEUED,
+    CCM_PATH_KNOWN,
+};
+
+/* NOTE
+ * Every path the up-to-date checks of a run look at is interned once: target
+ * outputs, sources, watched and discovered headers. Their metadata is filled
+ * by CCM_STAT_THREADS workers before the sweep, so a header listed by a
+ * thousand targets costs a single stat and the latency of a slow filesystem
+ * is paid in parallel. Entries are forgotten when a job rewrites the path and
+ * go back to unknown at the start of every run. Lookups of paths that were
+ * never interned stat directly.
+ */
+struct ccm_path_stat {
+    s64 mtime_ns;               /* -1 when the path does not exist */
+    s64 ctime_ns;
+    u64 size;
+    u64 ino;
+    s32 state;
+};
+struct ccm_path_table {
+    ccm_hmap lookup;            /* path hash -> index */
+    u32 next;                   /* the next queued path a worker takes */
+    struct { lll cap; lll len; c8 const **items; } paths;
+    struct { lll cap; lll len; ccm_path_stat *items; } stats;
+    struct { lll cap; lll len; u32 *items; } queued;
+};
+
+void ccm_path_queue(ccm_path_table *pt, c8 const *path);
+void ccm_path_fill(ccm_path_table *pt, s32 nthreads);
+bool ccm_path_lookup(ccm_path_table *pt, c8 const *path, ccm_path_stat *st);
+void ccm_path_forget(ccm_path_table *pt, c8 const *path);
+void ccm_path_reset(ccm_path_table *pt);
+void ccm_path_table_deinit(ccm_path_table *pt);
+
+// -----------------------------------------------------------------------------
+// [12] Build Database
+// -----------------------------------------------------------------------------
+#ifndef CCM_OBJDIR_DEFAULT_PATH
+#define CCM_OBJDIR_DEFAULT_PATH ".ccm/obj"
+#endif /* CCM_OBJDIR_DEFAULT_PATH */
+
+#ifndef CCM_DB_DEFAULT_PATH
+#define CCM_DB_DEFAULT_PATH ".ccm/db"
+#endif /* CCM_DB_DEFAULT_PATH */
+
+#ifndef CCM_DB_INITIAL_CAP
+#define CCM_DB_INITIAL_CAP 1024 /* records, must be a power of 2 */
+#endif /* CCM_DB_INITIAL_CAP */
+
+#define CCM_DB_MAGIC   0x44434343u /* "CCCD" */
+#define CCM_DB_VERSION 2
+
+enum /* ccm_db_record.kind */ {
+    CCM_DB_FILE   = 1,
+    CCM_DB_TARGET = 2,
+};
+
+/* NOTE
+ * The database is a flat open-addressing hash table mapped straight from
+ * disk: a fixed header followed by `cap` records. Keys are 64-bit hashes of
+ * the path combined with the record kind, a slot matches on both the key and
+ * the kind, key 0 marks an empty slot.
+ *
+ * CCM_DB_FILE records cache the content hash of a file together with the stat
+ * metadata it was computed for, so an unchanged file costs a single stat.
+ * CCM_DB_TARGET records hold the combined hash of the inputs a target was last
+ * successfully built from, the hash of the output it produced and the hash of
+ * the command that built it. Input and output hashes are only kept for hash
+ * checks and restat, see ccm_spec_content_checks.
+ */
+struct ccm_db_header {
+    u32 magic;
+    u32 version;
+    u64 cap;
+    u64 len;
+    u64 reserved[5];
+};
+struct ccm_db_record {
+    u64 key;
+    u32 kind;
+    u32 flags;
+    union {
+        struct {
+            s64 mtime_ns;
+            s64 ctime_ns;
+            u64 size;
+            u64 ino;
+            u64 hash;
+        } file;
+        struct {
+            u64 inputs;
+            u64 output;
+            s64 duration_ns;
+            u64 command;        /* ccm_command_hash, 0 if unknown */
+            s64 maxrss_kb;      /* peak memory of the job, 0 if unknown */
+        } target;
+    };
+};
+struct ccm_db {
+    s32 fd;
+    lll size;
+    ccm_db_header *header;
+    ccm_db_record *records;
+    ccm_path_table *paths;      /* metadata of the current run, NULL stats directly */
+};
+
+bool ccm_db_open(ccm_db *db, c8 const *path);
+void ccm_db_close(ccm_db *db);
+
+ccm_db_record *ccm_db_get(ccm_db *db, u32 kind, c8 const *name);
+ccm_db_record *ccm_db_put(ccm_db *db, u32 kind, c8 const *name);
+
+u64  ccm_db_file_hash(ccm_db *db, c8 const *path);
+
+// -----------------------------------------------------------------------------
+// [13] Dependency Log
+// -----------------------------------------------------------------------------
+#ifndef CCM_DEPLOG_DEFAULT_PATH
+#define CCM_DEPLOG_DEFAULT_PATH ".ccm/deps"
+#endif /* CCM_DEPLOG_DEFAULT_PATH */
+
+#define CCM_DEPLOG_MAGIC   "ccmdeps"
+#define CCM_DEPLOG_VERSION 1
+
+/* NOTE
+ * Headers discovered through compiler depfiles are kept in an append-only
+ * log, the same layout ninja uses for .ninja_deps. Every record starts with a
+ * u32 holding the payload size, with the high bit set for deps records:
+ *
+ *     path record: path bytes, NUL padded to 4 bytes, u32 checksum (~id)
+ *     deps record: u32 output id, u32 input ids...
+ *
+ * Paths get consecutive ids in the order they appear, and the last deps
+ * record of an output wins. The log is recompacted on load once it carries
+ * too many dead records.
+ */
+struct ccm_deplog_entry {
+    lll len;
+    u32 const *ids;
+};
+struct ccm_deplog {
+    s32 fd;
+    lll nrecords;
+    c8 *buf;
+    ccm_arena *arena;
+    ccm_hmap lookup;
+    struct { lll cap; lll len; c8 const **items; } paths;
+    struct { lll cap; lll len; ccm_deplog_entry *items; } deps;
+};
+
+bool ccm_deplog_open(ccm_deplog *log, c8 const *path, ccm_arena *arena);
+void ccm_deplog_close(ccm_deplog *log);
+
+ccm_deplog_entry const *ccm_deplog_get(ccm_deplog const *log, c8 const *output);
+bool ccm_deplog_record(ccm_deplog *log, c8 const *output, ccm_str8_dynarray const *inputs);
+bool ccm_deplog_ingest(ccm_deplog *log, c8 const *output, c8 const *depfile);
+
+// -----------------------------------------------------------------------------
+// [14] Compilation Cache
+// -----------------------------------------------------------------------------
+#ifndef CCM_CACHE_MAX_BYTES
+#define CCM_CACHE_MAX_BYTES (5ll << 30) /* 5gb */
+#endif /* CCM_CACHE_MAX_BYTES */
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif /* FICLONE */
+
+/* NOTE
+ * Content addressed store of compiler outputs, shared between checkouts and
+ * branches. Single translation unit jobs with a depfile are cached in two
+ * steps, the way ccache's direct mode works:
+ *
+ *     m/<primary>  the inputs the depfile listed, one path per line
+ *     o/<key>      the output
+ *
+ * primary hashes the command (minus the output and depfile names), the
+ * working directory, the compiler identity and the sources. key adds the
+ * contents of every input in the manifest. Outputs are hardlinked in and
+ * out of the store, so outputs of cacheable jobs are unlinked before the
+ * compiler runs, it must never write into a file the store owns. Entry
+ * mtimes are bumped on every hit and the oldest go first once the store
+ * grows past max_bytes.
+ */
+struct ccm_cache {
+    c8  *dir;
+    lll max_bytes;
+    u64 compiler;               /* identity of ccm_spec.compiler */
+    u64 cwd;
+    s32 hits;
+    s32 misses;
+    s32 stores;
+};
+
+bool ccm_cache_open(ccm_cache *c, c8 *dir, lll max_bytes, c8 const *compiler);
+bool ccm_cache_fetch(ccm_spec *spec, ccm_target const *t, u64 primary);
+void ccm_cache_store(ccm_spec *spec, ccm_target const *t, u64 primary);
+void ccm_cache_trim(ccm_cache *c);
+
+// -----------------------------------------------------------------------------
+// [15] Build Trace
+// -----------------------------------------------------------------------------
+/* NOTE
+ * Trace Event Format (chrome://tracing, ui.perfetto.dev) export. The event
+ * loop only appends fixed size records, names point at strings that outlive
+ * the run, all formatting happens in ccm_trace_write after the build. Jobs
+ * use their proc manager slot + 1 as tid, so the j lanes show holes in the
+ * parallelism directly; tid 0 holds the driver's own spans.
+ */
+struct ccm_trace_event {
+    c8 const *name;
+    c8 const *cat;
+    s64 start_ns;
+    s64 end_ns;
+    s32 tid;
+    s32 pid;                    /* child pid, 0 for driver spans */
+    s32 status;                 /* exit status, 128 + signal when killed */
+};
+struct ccm_trace {
+    bool on;
+    s32 lanes;
+    struct { lll cap; lll len; ccm_trace_event *items; } events;
+};
+
+s64  ccm_trace_begin(ccm_trace const *tr);
+void ccm_trace_end(ccm_trace *tr, c8 const *name, s64 start_ns);
+void ccm_trace_job(ccm_trace *tr, ccm_target const *t, s32 lane, s32 pid, s32 status);
+bool ccm_trace_write(ccm_trace *tr, c8 const *path);
+
+// -----------------------------------------------------------------------------
+// [16] Manifest
+// -----------------------------------------------------------------------------
+#ifndef CCM_MANIFEST_DEFAULT_PATH
+#define CCM_MANIFEST_DEFAULT_PATH ".ccm/manifest"
+#endif /* CCM_MANIFEST_DEFAULT_PATH */
+
+#define CCM_MANIFEST_MAGIC   0x4d434343u /* "CCCM" */
+#define CCM_MANIFEST_VERSION 1
+
+/* NOTE
+ * The scheduled graph of the last run, so a no-op run maps it instead of
+ * sorting the targets and building every argv again. It is keyed by the
+ * identity of the spec binary and a hash of the targets it declared (see
+ * ccm_spec_fingerprint), a spec that reads argv or the environment into its
+ * targets gets a fresh manifest whenever those change. A spec with a
+ * ccm_spec.command hook always runs without one, its argv can't be keyed.
+ *
+ * Everything after the header is an offset or an index, in file order:
+ *
+ *     u64 command[n]        ccm_command_hash of every target
+ *     u32 order[n]          listing index of the target at each position
+ *     s32 level[n]
+ *     u32 dep_off[n + 1], dep_idx[m], rev_off[n + 1], rev_idx[m]
+ *     u32 argc[n], argv[n]  argv strings are consecutive in the pool
+ *     u32 depfile[n]        0 when the target has none
+ *     c8  pool[]            NUL terminated strings, starting with ""
+ */
+struct ccm_manifest_header {
+    u32 magic;
+    u32 version;
+    u64 key;
+    u64 size;                   /* of the whole file, a short write never loads */
+    u32 n;
+    u32 m;
+};
+struct ccm_manifest {
+    c8 const *path;             /* NULL runs without one */
+    ccm_manifest_header *header;
+    u64 *command;
+    u32 *order;
+    s32 *level;
+    u32 *dep_off;
+    u32 *dep_idx;
+    u32 *rev_off;
+    u32 *rev_idx;
+    u32 *argc;
+    u32 *argv;
+    u32 *depfile;
+    c8  *pool;
+};
+
+u64  ccm_manifest_layout(ccm_manifest *mf, u8 *base, u32 n, u32 m);
+bool ccm_manifest_check(ccm_manifest const *mf, u64 pool_len);
+bool ccm_manifest_load(ccm_manifest *mf, u64 key);
+bool ccm_manifest_write(ccm_spec *spec, u64 key);
+void ccm_manifest_close(ccm_manifest *mf);
+
+// -----------------------------------------------------------------------------
+// [17] Build Specification & Build Targets
 // -----------------------------------------------------------------------------
 #define ccm_str8_array_len(...) ccm_countof(((c8 *[]){__VA_ARGS__}))
 #define ccm_str8_array(...)                     \
@@ -364,6 +989,11 @@ struct ccm_target_array {
     lll len;
     ccm_target **items;
 };
+enum /* ccm_target.kind */ {
+    CCM_TARGET_DEFAULT = 0,
+    CCM_TARGET_OBJECT,          /* one source compiled with -c, see ccm_spec.objects */
+    CCM_TARGET_LINK,            /* links the objects split out of a default target */
+};
 struct ccm_target {
     c8 *name;
     ccm_str8_array sources;
@@ -372,40 +1002,184 @@ struct ccm_target {
     ccm_str8_array post_opts;
 
     ccm_target_array deps;
-    ccm_target_array revdeps;
 
-    s32 level;
-    s32 visited;
-    s32 collected;
+    ccm_pool *pool;             /* NULL is only bound by ccm_spec.j */
+    s32 slots;                  /* job slots taken while running, 0 is 1 */
+    lll mem_kb;                 /* expected peak memory, 0 learns it from previous runs */
+
+    s32 kind;
+    u32 id;                     /* index into spec->deps and spec->graph once scheduled */
+    s64 mtime_ns;               /* output mtime, stat'ed once a run, -1 missing, 0 unknown */
+
+    c8 **cmd;                   /* built once, the graph stays resident */
+    c8 *depfile;
+
+    s64 weight;                 /* expected duration, ns or unit weights */
+    s64 priority;               /* longest weighted path from here to a sink */
+    lll mem_est_kb;             /* mem_kb, or the maxrss of the last run */
+    s64 start_ns;               /* CLOCK_MONOTONIC */
+    s64 end_ns;
+    s64 utime_ns;               /* child cpu time, from wait4 */
+    s64 stime_ns;
+    lll maxrss_kb;
+    ccm_target *critical;       /* next target on the predicted critical path */
+    ccm_target *last_dep;       /* the dependency that finished last */
+};
+/* NOTE
+ * The scheduled graph, in u32 target ids. The deps of target `i` are
+ * dep_idx[dep_off[i] .. dep_off[i + 1]), revdeps the same way over rev_off and
+ * rev_idx. Ids follow the topological order of spec->deps, so every dep has a
+ * smaller id than its dependents. The fields the scheduler touches per edge
+ * live here as arrays rather than in ccm_target.
+ */
+struct ccm_graph {
+    u32 n;
+    u32 *order;                 /* listing index of every target, see ccm_spec_schedule */
+    u32 *dep_off;
+    u32 *dep_idx;
+    u32 *rev_off;
+    u32 *rev_idx;
+    s32 *level;                 /* 1 + the deepest dep, sources are 1 */
+    s32 *pending;               /* active deps that have not finished this run */
+    u32 *stack;                 /* for the walks of the run loop, see ccm_target_propagate_done */
+    u8  *state;                 /* CCM_NODE_* */
+};
+enum /* ccm_graph.state */ {
+    CCM_NODE_ACTIVE      = 1 << 0,  /* part of the current run */
+    CCM_NODE_DIRTY       = 1 << 1,  /* an input changed while watching */
+    CCM_NODE_STALE       = 1 << 2,  /* a dep was rebuilt into a different output this run */
+    CCM_NODE_DONE        = 1 << 3,  /* built, cut off or up to date this run */
+    CCM_NODE_FAILED      = 1 << 4,  /* its job failed this run */
+    CCM_NODE_SKIPPED     = 1 << 5,  /* depends on a failed target */
+    CCM_NODE_INTERRUPTED = 1 << 6,  /* its job was killed by ccm_proc_mgr_stop */
+};
+#define CCM_GRAPH_NONE UINT32_MAX
+
+#define ccm_graph_deps(g, i)    ((g)->dep_off[(i) + 1] - (g)->dep_off[(i)])
+#define ccm_graph_revdeps(g, i) ((g)->rev_off[(i) + 1] - (g)->rev_off[(i)])
+
+enum /* ccm_spec.check */ {
+    CCM_CHECK_MTIME = 0,
+    CCM_CHECK_HASH,
 };
+/* builds the argv of a target's job, see ccm_spec.command */
+typedef c8 **(*ccm_command_fn)(ccm_spec *spec, ccm_target const *t);
+
 struct ccm_spec {
-    s32 j;
+    s32 j;                      /* 0 adapts to the machine, see ccm_load */
+    s32 check;
     c8 *compiler;
+    ccm_command_fn command;     /* NULL runs ccm_compile_cmd, a hook disables the manifest */
     c8 *output_flag;
+    c8 *db_path;                /* NULL is CCM_DB_DEFAULT_PATH, "" runs without one */
+    c8 *manifest_path;          /* NULL is CCM_MANIFEST_DEFAULT_PATH, "" runs without one */
+    c8 *objdir;
+    bool depfiles;
+    bool objects;
+    bool jobserver;             /* serve a make jobserver to the children */
+    bool restat;                /* early cutoff, see ccm_target_restat */
+    s32 output;                 /* CCM_OUTPUT_*, what happens to the output of jobs */
+    s32 keep_going;             /* failures to stop at, 0 is the first, -1 never stops */
+    s32 failed;                 /* jobs that failed or were interrupted in the last run */
+    bool scheduled;             /* deps are topologically sorted, graph is built */
+    c8 *cache_dir;              /* NULL disables the compilation cache */
+    lll cache_max_bytes;
+    lll mem_budget_kb;          /* expected memory of all running jobs, 0 is unlimited */
+    c8 *trace_path;             /* Trace Event Format JSON, NULL disables tracing */
+    ccm_db db;
+    ccm_deplog deplog;
+    ccm_cache cache;
+    ccm_trace trace;
+    ccm_manifest manifest;
+    ccm_path_table paths;
     ccm_arena arena;
+    ccm_graph graph;
     ccm_str8_array common_opts;
+    ccm_str8_array select;      /* names or fnmatch(3) patterns, empty builds every target */
     ccm_target_array deps;
 };
 void  ccm_stats(void);
 
 void ccm_target_cmd(ccm_str8_dynarray sb, ccm_childproc *cp);
-bool ccm_target_needs_rebuild(ccm_target const *t);
+s64  ccm_target_mtime(ccm_path_table *pt, ccm_target *t);
+bool ccm_target_needs_rebuild(ccm_path_table *pt, ccm_target *t);
+void ccm_spec_stat_prepass(ccm_spec *spec);
+bool ccm_spec_needs_rebuild(ccm_spec *spec, ccm_target *t);
+bool ccm_spec_content_checks(ccm_spec const *spec);
+bool ccm_target_needs_rebuild_hash(ccm_spec *spec, ccm_target const *t);
+u64  ccm_command_hash(c8 **cmd);
+c8 **ccm_target_command(ccm_spec *spec, ccm_target *t);
+u64  ccm_target_command_hash(ccm_spec *spec, ccm_target *t);
+bool ccm_target_command_changed(ccm_spec *spec, ccm_target *t);
+bool ccm_target_restat(ccm_spec *spec, ccm_target const *t);
+u64  ccm_target_inputs_hash(ccm_spec *spec, ccm_target const *t);
+u64  ccm_target_cache_key(ccm_spec *spec, ccm_target const *t, c8 **cmd);
+c8  *ccm_target_depfile(ccm_spec *spec, ccm_target const *t);
+void ccm_target_record(ccm_spec *spec, ccm_target const *t, u64 inputs, u64 command,
+                       s64 duration_ns);
+
+bool ccm_spec_prioritize(ccm_spec *spec);
+void ccm_spec_report_critical_path(ccm_spec *spec, bool history);
+
+/* rows of the end of build cost table */
+#ifndef CCM_COST_TABLE_ROWS
+#define CCM_COST_TABLE_ROWS 20
+#endif /* CCM_COST_TABLE_ROWS */
+void ccm_spec_report_costs(ccm_spec *spec);
 c8 **ccm_compile_cmd(ccm_spec *spec, ccm_target const *t);
 
-s32  ccm_spec_schedule_target(ccm_spec *spec, ccm_target *t, ccm_target_array *ta);
+u64  ccm_spec_fingerprint(ccm_spec const *spec);
+bool ccm_target_matches(ccm_target const *t, c8 const *pattern);
+void ccm_spec_select(ccm_spec *spec);
+void ccm_graph_link(ccm_graph *g, ccm_arena *arena, ccm_target_array ts);
+u32  ccm_graph_sort(ccm_graph const *g, ccm_arena *scratch, u32 *order, s32 *level);
+void ccm_spec_expand_objects(ccm_spec *spec);
 void ccm_spec_schedule(ccm_spec *spec);
+void ccm_spec_prepare(ccm_spec *spec);
 
 void ccm_spec_build_target(ccm_spec *spec, ccm_target const *t);
+void ccm_spec_open(ccm_spec *spec);
+void ccm_spec_close(ccm_spec *spec);
 void ccm_spec_build(ccm_spec *spec);
+void ccm_spec_watch(ccm_spec *spec);
 void ccm_spec_clean(ccm_spec *spec);
 
 void ccm_bootstrap(s32 argc, c8 **argv);
 
 c8   *ccm_shift_args(s32 *argc, c8 ***argv);
 
-void  ccm_cmd_print(ccm_arena a, c8 **cmd);
+void  ccm_cmd_print(ccm_arena *scratch, c8 **cmd);
+
+
+// -----------------------------------------------------------------------------
+// [18] Watch Mode
+// -----------------------------------------------------------------------------
+#define CCM_WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB)
+
+/* NOTE
+ * ccm_spec_watch keeps the scheduled graph, the proc manager and the open
+ * db/deplog around and waits on inotify. Directories are watched rather than
+ * files, editors save by renaming over the old file. Every input (sources,
+ * watch, logged headers) is keyed by the hash of its real directory and its
+ * name, which is also what an event carries, so an event maps to the targets
+ * reading that file without touching the file system.
+ */
+struct ccm_watch_node {
+    ccm_target *target;
+    u32 next;                   /* index + 1 of the next node, 0 ends the list */
+};
+struct ccm_watcher {
+    s32 fd;
+    s32 nfiles;
+    ccm_hmap files;             /* input key -> index + 1 of its first node */
+    ccm_hmap outputs;           /* keys of target outputs, never watched */
+    struct { lll cap; lll len; u64 *items; } dirs;  /* wd -> real directory hash */
+    struct { lll cap; lll len; ccm_watch_node *items; } nodes;
+};
 
-void ccm_compute_dependents(ccm_spec *spec);
+void ccm_watcher_index(ccm_watcher *w, ccm_spec *spec);
+s32  ccm_watcher_dispatch(ccm_watcher *w, ccm_spec *spec, c8 const *buf, lll len);
+void ccm_watcher_deinit(ccm_watcher *w);
 
 
 #endif /* CCM_H */
@@ -425,6 +1199,100 @@ s32 ccm_s32_min(s32 a, s32 b)
     return a < b ? a : b;
 }
 
+s64 ccm_s64_max(s64 a, s64 b)
+{
+    return a > b ? a : b;
+}
+
+s64 ccm_s64_min(s64 a, s64 b)
+{
+    return a < b ? a : b;
+}
+
+/* 64x64 -> 128 multiply folded back to 64 bits, the mixing step of ccm_hash64 */
+u64 ccm_mum(u64 a, u64 b)
+{
+    __uint128_t r = (__uint128_t)a * b;
+    return (u64)r ^ (u64)(r >> 64);
+}
+
+/* fast non-cryptographic hash, good enough to detect content changes */
+u64 ccm_hash64(void const *data, lll len, u64 seed)
+{
+    static u64 const p0 = 0xa0761d6478bd642full;
+    static u64 const p1 = 0xe7037ed1a0b428dbull;
+    static u64 const p2 = 0x8ebc6af09c88c6e3ull;
+
+    u8 const *p = data;
+    u64 h = seed ^ p0 ^ (u64)len;
+    lll n = len;
+    u64 a = 0, b = 0;
+
+    for (; n >= 16; n -= 16, p += 16) {
+        memcpy(&a, p, 8);
+        memcpy(&b, p + 8, 8);
+        h = ccm_mum(a ^ p1 ^ h, b ^ p2);
+    }
+
+    u8 tail[16] = {0};
+    memcpy(tail, p, n);
+    memcpy(&a, tail, 8);
+    memcpy(&b, tail + 8, 8);
+    h = ccm_mum(a ^ p1 ^ h, b ^ p2 ^ (u64)n);
+
+    return ccm_mum(h ^ p0, p1 ^ (u64)len);
+}
+
+u64 ccm_hash_str8(c8 const *s, u64 seed)
+{
+    return ccm_hash64(s, strlen(s), seed);
+}
+
+/* order dependent combination of two hashes */
+u64 ccm_hash_combine(u64 h, u64 v)
+{
+    return ccm_mum(h ^ v, 0x9e3779b97f4a7c15ull);
+}
+
+u64 ccm_hash_str8_array(u64 h, ccm_str8_array a)
+{
+    h = ccm_hash_combine(h, a.len);
+    for (s32 i = 0; i < a.len; ++i) h = ccm_hash_combine(h, ccm_hash_str8(a.items[i], 0));
+    return h;
+}
+
+s64 ccm_timespec_ns(struct timespec ts)
+{
+    return (s64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+s64 ccm_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ccm_timespec_ns(ts);
+}
+
+/* create every missing parent directory of the file `path` */
+bool ccm_mkdir_parents(c8 const *path)
+{
+    c8 buf[PATH_MAX];
+    lll len = strlen(path);
+    if (len >= (lll)sizeof(buf)) return false;
+    memcpy(buf, path, len + 1);
+
+    for (c8 *p = buf + 1; *p; ++p) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(buf, 0755) < 0 && errno != EEXIST) {
+            ccm_log(CCM_LOG_ERROR, "mkdir %s failed: %s\n", buf, strerror(errno));
+            return false;
+        }
+        *p = '/';
+    }
+    return true;
+}
+
 // -----------------------------------------------------------------------------
 // Logger
 // -----------------------------------------------------------------------------
@@ -474,16 +1342,43 @@ void ccm_sep(s32 len)
 // -----------------------------------------------------------------------------
 // Arena
 // -----------------------------------------------------------------------------
-ccm_arena ccm_arena_init(lll capacity)
+/* chain: starts a block of at least `need` bytes past its head */
+void ccm_arena_chain(ccm_arena *arena, lll need)
 {
-    ccm_arena arena = {0};
-    arena.memory = ccm_malloc(capacity);
-    if (arena.memory == NULL) {
-        ccm_panic("ERROR :: arena_init: backend malloc: out of memory\n");
+    lll cap = ccm_s64_max(CCM_ARENA_BLOCK_SIZE, need + sizeof(ccm_arena_block));
+    u8 *block = ccm_malloc(cap);
+    if (block == NULL) {
+        ccm_panic("ERROR :: arena_chain: backend malloc: out of memory\n");
     }
-    arena.cap = capacity;
-    arena.off = 0;
+    *(ccm_arena_block *)block = (ccm_arena_block){
+        .prev = arena->memory,
+        .cap  = arena->cap,
+        .off  = arena->off,
+        .base = arena->base,
+    };
+    arena->base  += arena->off;
+    arena->memory = block;
+    arena->cap    = cap;
+    arena->off    = sizeof(ccm_arena_block);
+    arena->nblocks += 1;
+}
 
+ccm_arena ccm_arena_init(lll capacity)
+{
+    ccm_arena arena = { .backend = CCM_ARENA_BACKEND };
+    if (arena.backend == CCM_ARENA_VM) {
+        void *p = mmap(NULL, capacity, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p != MAP_FAILED) {
+            arena.memory = p;
+            arena.cap = capacity;
+            return arena;
+        }
+        ccm_log(CCM_LOG_WARN, "arena_init: reserving %ld bytes: %s, chaining blocks\n",
+                capacity, strerror(errno));
+        arena.backend = CCM_ARENA_CHAIN;
+    }
+    ccm_arena_chain(&arena, 0);
     return arena;
 }
 
@@ -497,33 +1392,102 @@ void* ccm_arena_allocarray(ccm_arena *arena, lll itemsize, lll itemcount, lll al
 
     lll padding = -((uintptr_t)(arena->memory + arena->off)) & (align - 1);
     if (nbytes + padding > arena->cap - arena->off) {
-        ccm_panic("ERROR :: arena_alloc: out of memory\n");
+        if (arena->backend == CCM_ARENA_VM) {
+            ccm_panic("ERROR :: arena_alloc: out of memory\n");
+        }
+        ccm_arena_chain(arena, nbytes + align);
+        padding = -((uintptr_t)(arena->memory + arena->off)) & (align - 1);
     }
 
     arena->off += padding;
     void *p = arena->memory + arena->off;
     arena->off += nbytes;
 
+    if (arena->off > arena->commit && arena->backend == CCM_ARENA_VM) {
+        lll commit = ccm_s64_min(arena->cap, (arena->off + CCM_ARENA_COMMIT_SIZE - 1)
+                                 / CCM_ARENA_COMMIT_SIZE * CCM_ARENA_COMMIT_SIZE);
+        if (mprotect(arena->memory + arena->commit, commit - arena->commit,
+                     PROT_READ | PROT_WRITE) < 0) {
+            ccm_panic("ERROR :: arena_alloc: commit: %s\n", strerror(errno));
+        }
+        arena->commit = commit;
+    }
+    if (ccm_arena_used(arena) > arena->peak) arena->peak = ccm_arena_used(arena);
+
     return p;
 }
 
+lll ccm_arena_used(ccm_arena const *arena)
+{
+    return arena->base + arena->off;
+}
+
+ccm_arena_mark ccm_arena_save(ccm_arena const *arena)
+{
+    return (ccm_arena_mark){ .memory = arena->memory, .off = arena->off };
+}
+
+void ccm_arena_rewind(ccm_arena *arena, ccm_arena_mark mark)
+{
+    while (arena->memory != mark.memory && arena->backend == CCM_ARENA_CHAIN) {
+        ccm_arena_block head = *(ccm_arena_block *)arena->memory;
+        ccm_free(arena->memory);
+        arena->memory = head.prev;
+        arena->cap    = head.cap;
+        arena->off    = head.off;
+        arena->base   = head.base;
+        arena->nblocks -= 1;
+    }
+    arena->off = mark.off;
+}
+
 void ccm_arena_reset(ccm_arena *arena)
 {
-    arena->off = 0;
+    if (arena->backend == CCM_ARENA_VM) {
+        arena->off = 0;
+        return;
+    }
+    while (arena->nblocks > 1) {
+        ccm_arena_rewind(arena, (ccm_arena_mark){
+                .memory = ((ccm_arena_block *)arena->memory)->prev,
+            });
+    }
+    arena->off = sizeof(ccm_arena_block);
+}
+
+/* usage since the previous phase */
+void ccm_arena_phase(ccm_arena *arena, c8 const *name)
+{
+    lll used = ccm_arena_used(arena);
+    ccm_log(CCM_LOG_INFO, "arena: %-24s %+12ld bytes, %ld in use\n",
+            name, used - arena->phase, used);
+    arena->phase = used;
 }
 
 void ccm_arena_log_stats(ccm_arena *arena)
 {
-    ccm_log(CCM_LOG_INFO, "spec.arena total commited memory = %ld\n", arena->off);
+    if (arena->backend == CCM_ARENA_VM) {
+        ccm_log(CCM_LOG_INFO, "arena: %ld bytes in use, peak %ld, committed %ld of %ld reserved\n",
+                ccm_arena_used(arena), arena->peak, arena->commit, arena->cap);
+    } else {
+        ccm_log(CCM_LOG_INFO, "arena: %ld bytes in use, peak %ld, %d blocks\n",
+                ccm_arena_used(arena), arena->peak, arena->nblocks);
+    }
 }
 
 void ccm_arena_deinit(ccm_arena *arena)
 {
     ccm_arena_log_stats(arena);
-    ccm_free(arena->memory);
-    arena->cap = 0;
-    arena->off = 0;
-    arena->memory = NULL;
+    if (arena->backend == CCM_ARENA_VM) {
+        munmap(arena->memory, arena->cap);
+    } else {
+        while (arena->memory) {
+            u8 *prev = ((ccm_arena_block *)arena->memory)->prev;
+            ccm_free(arena->memory);
+            arena->memory = prev;
+        }
+    }
+    *arena = (ccm_arena){0};
 }
 // -----------------------------------------------------------------------------
 // Strings
@@ -539,7 +1503,7 @@ c8 *ccm_fmt(ccm_arena *arena, char const *fmt, ...)
 
     if (len < 0) return NULL;
 
-    lll mark = arena->off;
+    ccm_arena_mark mark = ccm_arena_save(arena);
     void *p = ccm_arena_alloc(c8, arena, len + 1); /* NOTE +1 */
 
     va_start(ap, fmt);
@@ -547,7 +1511,7 @@ c8 *ccm_fmt(ccm_arena *arena, char const *fmt, ...)
     va_end(ap);
 
     if (len < 0) {
-        arena->off = mark;
+        ccm_arena_rewind(arena, mark);
         return NULL;
     }
     return p;
@@ -622,224 +1586,2851 @@ void ccm_rb_print(ccm_ring_buffer const *rb)
 }
 
 // -----------------------------------------------------------------------------
-// [8] ChildProc
+// Priority Queue
 // -----------------------------------------------------------------------------
-bool ccm_childproc_fork(ccm_childproc *cp)
+/* whether `a` should start before `b`: longer remaining path first, then the
+ * one unblocking more dependents, then the shallower one */
+bool ccm_target_before(ccm_graph const *g, ccm_target const *a, ccm_target const *b)
 {
-    c8 *pathname = cp->cmd[0];
-    c8 **argv    = cp->cmd;
-    pid_t cpid   = fork();
+    if (a->priority != b->priority) return a->priority > b->priority;
+    u32 fa = ccm_graph_revdeps(g, a->id), fb = ccm_graph_revdeps(g, b->id);
+    if (fa != fb) return fa > fb;
+    return g->level[a->id] < g->level[b->id];
+}
 
-    switch (cpid) {
-    case -1: {
-        ccm_log(CCM_LOG_ERROR, "target [%s]: fork failed, %s\n",
-                cp->target->name,
-                strerror(errno));
-        return false;
-    }
-    case 0: {
-        close(cp->pipe.read);
-        dup2(cp->pipe.write, STDOUT_FILENO);
-        dup2(cp->pipe.write, STDERR_FILENO);
-        close(cp->pipe.write);
+ccm_prio_queue ccm_init_pq(ccm_arena *arena, ccm_graph const *graph, lll cap)
+{
+    ccm_prio_queue pq = {
+        .cap = cap,
+        .len = 0,
+        .graph = graph,
+        .items = ccm_arena_alloc(ccm_rbvalue_t, arena, cap),
+    };
+    return pq;
+}
 
-        if (execvp(pathname, (c8 *const*)argv) < 0) {
-            ccm_log(CCM_LOG_ERROR, "execvp failed!\n");
-            exit(1);
-        }
-        ccm_unreachable();
-    }
-    default: {
-        close(cp->pipe.write);
-        cp->pid = cpid;
-        cp->time = clock();
-    }
+void ccm_pq_push(ccm_prio_queue *pq, ccm_rbvalue_t v)
+{
+    ccm_assert(pq->len < pq->cap);
+    s32 i = pq->len++;
+    for (; i > 0 && ccm_target_before(pq->graph, v, pq->items[(i - 1) / 2]); i = (i - 1) / 2) {
+        pq->items[i] = pq->items[(i - 1) / 2];
     }
-    return true;
+    pq->items[i] = v;
 }
 
-void ccm_childproc_read(ccm_childproc *cp)
+ccm_rbvalue_t ccm_pq_pop(ccm_prio_queue *pq)
 {
-    c8 *buf = cp->report.items + cp->report.len;
-    lll read_len = cp->report.cap - cp->report.len;
-    lll n = 0;
-    for (s32 i = 0; (n = read(cp->pipe.read, buf, read_len)) ; ++i) {
-        if (n == -1 && errno == EINTR) continue;
-        if (n == -1 && errno == EAGAIN) {
-            break;
-        }
-        if (n == -1) {
-            ccm_log(CCM_LOG_ERROR, "read: child %d failed: %s\n",
-                    cp->pid, strerror(errno));
-            break;
-        }
-        cp->report.len += n;
-        buf += n;
-        read_len -= n;
-        if (read_len == 0) {
-            ccm_da_grow(&cp->report, cp->report.cap * 2);
-            buf = cp->report.items + cp->report.len;
-            read_len = cp->report.cap - cp->report.len;
+    ccm_assert(pq->len > 0);
+    ccm_rbvalue_t top  = pq->items[0];
+    ccm_rbvalue_t last = pq->items[--pq->len];
+
+    s32 i = 0;
+    for (;;) {
+        s32 child = 2 * i + 1;
+        if (child >= pq->len) break;
+        if (child + 1 < pq->len && ccm_target_before(pq->graph, pq->items[child + 1], pq->items[child])) {
+            ++child;
         }
+        if (!ccm_target_before(pq->graph, pq->items[child], last)) break;
+        pq->items[i] = pq->items[child];
+        i = child;
     }
+    if (pq->len > 0) pq->items[i] = last;
+    return top;
 }
 
-void ccm_childproc_report(ccm_childproc *cp)
+ccm_rbvalue_t ccm_pq_peek(ccm_prio_queue const *pq)
 {
-    write(STDOUT_FILENO, cp->report.items, cp->report.len);
-    ccm_sep(80);
-    /* reset the report buffer */
-    memset(cp->report.items, 0, cp->report.len);
-    cp->report.len = 0;
+    return pq->len > 0 ? pq->items[0] : NULL;
 }
 
+void ccm_pq_print(ccm_prio_queue const *pq)
+{
+    ccm_log(CCM_LOG_DEBUG, "pq->cap = %d, pq->len = %d\n", pq->cap, pq->len);
+    for (s32 i = 0; i < pq->len; ++i) {
+        ccm_log(CCM_LOG_NONE, "pq[%d] = {%s: %ld}%s", i,
+                pq->items[i]->name, pq->items[i]->priority,
+                i == pq->len - 1 ? "\n" : ", ");
+    }
+}
 
 // -----------------------------------------------------------------------------
-// ChildProc Manager
+// Hash Map
 // -----------------------------------------------------------------------------
-bool ccm_proc_mgr_add_target(ccm_proc_mgr *pm, ccm_target *t)
+u64 *ccm_hmap_probe(u64 *keys, lll cap, u64 key)
 {
-    if (pm->nrunning == pm->maxjobs) return false;
-    s32 next_child = pm->nrunning;
-    ccm_spec *spec = pm->spec;
-
-    pm->evs[next_child] = 0;
-
-    pm->cps[next_child].target = t;
-    pm->cps[next_child].cmd = ccm_compile_cmd(spec, t);
-
-    if (pipe2((int*)&pm->cps[next_child].pipe, O_NONBLOCK) < 0) {
-        ccm_panic("ccm_proc_mgr_add_target: pipe2 failed, %s\n", strerror(errno));
+    lll mask = cap - 1;
+    for (lll i = key & mask;; i = (i + 1) & mask) {
+        if (keys[i] == key || keys[i] == 0) return &keys[i];
     }
+}
 
-    pm->pfds[next_child].fd = pm->cps[next_child].pipe.read;
-    pm->pfds[next_child].events = POLLIN;
-
-    ++pm->nrunning;
-
-    /* forks the child and sets up the pipe */
-    ccm_childproc_fork(&pm->cps[next_child]);
-
+bool ccm_hmap_get(ccm_hmap const *m, u64 key, u32 *val)
+{
+    if (m->cap == 0) return false;
+    key = key == 0 ? 1 : key;
+    u64 *k = ccm_hmap_probe(m->keys, m->cap, key);
+    if (*k == 0) return false;
+    *val = m->vals[k - m->keys];
     return true;
 }
 
-void ccm_target_propagate_done(ccm_target const *t, ccm_ring_buffer *ready_queue)
+void ccm_hmap_put(ccm_hmap *m, u64 key, u32 val)
 {
-    for (s32 i = 0; i < t->revdeps.len; ++i) {
-        ccm_target *rt = t->revdeps.items[i];
-        --rt->deps.len;
-        if (rt->deps.len == 0) {
-            ccm_rb_push(ready_queue, rt);
+    key = key == 0 ? 1 : key;
+    if (4 * (m->len + 1) > 3 * m->cap) {
+        ccm_hmap grown = { .cap = m->cap == 0 ? CCM_DA_INITIAL_CAP : m->cap * 2 };
+        grown.keys = ccm_calloc(grown.cap * sizeof(u64));
+        grown.vals = ccm_malloc(grown.cap * sizeof(u32));
+        if (grown.keys == NULL || grown.vals == NULL) {
+            ccm_panic("ccm_hmap_put: out of memory\n");
         }
+        for (lll i = 0; i < m->cap; ++i) {
+            if (m->keys[i] == 0) continue;
+            u64 *k = ccm_hmap_probe(grown.keys, grown.cap, m->keys[i]);
+            *k = m->keys[i];
+            grown.vals[k - grown.keys] = m->vals[i];
+        }
+        grown.len = m->len;
+        ccm_hmap_deinit(m);
+        *m = grown;
     }
+
+    u64 *k = ccm_hmap_probe(m->keys, m->cap, key);
+    if (*k == 0) ++m->len;
+    *k = key;
+    m->vals[k - m->keys] = val;
+}
+
+void ccm_hmap_deinit(ccm_hmap *m)
+{
+    ccm_free(m->keys);
+    ccm_free(m->vals);
+    *m = (ccm_hmap){0};
 }
 
 // -----------------------------------------------------------------------------
-// Core
+// Path Table
 // -----------------------------------------------------------------------------
-
 #ifdef CCM_STATS
-#define fork()          (++fork_count, vfork())
-#define exec(...)       (++exec_count, exec(__VA_ARGS__))
+/* NOTE ahead of ccm_path_stat_fill, which does almost every stat of a build */
 #define stat(path, buf) (++stat_count,                                  \
                          ccm_log(CCM_LOG_INFO, "%s: %d, stat(%s)\n",    \
                                  __FILE_NAME__, __LINE__, path),        \
                          stat(path, buf))
 
-static s32 fork_count = 0;
-static s32 exec_count = 0;
 static s32 stat_count = 0;
+#endif /* CCM_STATS */
 
-void ccm_stats(void)
+void ccm_path_stat_fill(ccm_path_stat *ps, c8 const *path)
 {
-    ccm_log(CCM_LOG_DEBUG, "CCM_STATS: fork_count = %d\n", fork_count);
-    ccm_log(CCM_LOG_DEBUG, "CCM_STATS: exec_count = %d\n", exec_count);
-    ccm_log(CCM_LOG_DEBUG, "CCM_STATS: stat_count = %d\n", stat_count);
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        *ps = (ccm_path_stat){ .mtime_ns = -1, .state = CCM_PATH_KNOWN };
+        return;
+    }
+    *ps = (ccm_path_stat){
+        .mtime_ns = ccm_timespec_ns(st.st_mtim),
+        .ctime_ns = ccm_timespec_ns(st.st_ctim),
+        .size     = st.st_size,
+        .ino      = st.st_ino,
+        .state    = CCM_PATH_KNOWN,
+    };
 }
-#endif /* CCM_STATS */
 
+/* `path` must outlive the table, target names and deplog paths do */
+void ccm_path_queue(ccm_path_table *pt, c8 const *path)
+{
+    u32 id;
+    if (!ccm_hmap_get(&pt->lookup, ccm_hash_str8(path, 0), &id)) {
+        id = pt->paths.len;
+        ccm_da_append(&pt->paths, path);
+        ccm_da_append(&pt->stats, (ccm_path_stat){0});
+        ccm_hmap_put(&pt->lookup, ccm_hash_str8(path, 0), id);
+    }
+    if (pt->stats.items[id].state != CCM_PATH_UNKNOWN) return;
+    pt->stats.items[id].state = CCM_PATH_QUEUED;
+    ccm_da_append(&pt->queued, id);
+}
+
+void *ccm_path_worker(void *arg)
+{
+    ccm_path_table *pt = arg;
+    for (;;) {
+        u32 at = __atomic_fetch_add(&pt->next, CCM_STAT_BATCH, __ATOMIC_RELAXED);
+        if (at >= pt->queued.len) return NULL;
+        u32 end = ccm_s64_min(at + CCM_STAT_BATCH, pt->queued.len);
+        for (u32 k = at; k < end; ++k) {
+            u32 id = pt->queued.items[k];
+            ccm_path_stat_fill(&pt->stats.items[id], pt->paths.items[id]);
+        }
+    }
+}
+
+/* stats everything queued, the driver works alongside up to nthreads - 1 workers */
+void ccm_path_fill(ccm_path_table *pt, s32 nthreads)
+{
+    pthread_t workers[CCM_STAT_THREADS];
+    s32 batches  = (pt->queued.len + CCM_STAT_BATCH - 1) / CCM_STAT_BATCH;
+    s32 nworkers = ccm_s32_min(ccm_s32_min(nthreads, CCM_STAT_THREADS), batches) - 1;
+
+    pt->next = 0;
+    s32 started = 0;
+    for (; started < nworkers; ++started) {
+        if (pthread_create(&workers[started], NULL, ccm_path_worker, pt) != 0) break;
+    }
+    ccm_path_worker(pt);
+    for (s32 i = 0; i < started; ++i) pthread_join(workers[i], NULL);
+    pt->queued.len = 0;
+}
+
+bool ccm_path_lookup(ccm_path_table *pt, c8 const *path, ccm_path_stat *st)
+{
+    u32 id;
+    if (pt && ccm_hmap_get(&pt->lookup, ccm_hash_str8(path, 0), &id)) {
+        ccm_path_stat *ps = &pt->stats.items[id];
+        if (ps->state != CCM_PATH_KNOWN) ccm_path_stat_fill(ps, path);
+        *st = *ps;
+    } else {
+        ccm_path_stat_fill(st, path);
+    }
+    return st->mtime_ns >= 0;
+}
+
+void ccm_path_forget(ccm_path_table *pt, c8 const *path)
+{
+    u32 id;
+    if (pt && ccm_hmap_get(&pt->lookup, ccm_hash_str8(path, 0), &id)) {
+        pt->stats.items[id].state = CCM_PATH_UNKNOWN;
+    }
+}
+
+void ccm_path_reset(ccm_path_table *pt)
+{
+    for (lll i = 0; i < pt->stats.len; ++i) pt->stats.items[i].state = CCM_PATH_UNKNOWN;
+    pt->queued.len = 0;
+}
+
+void ccm_path_table_deinit(ccm_path_table *pt)
+{
+    ccm_hmap_deinit(&pt->lookup);
+    if (pt->paths.items)  ccm_da_deinit(&pt->paths);
+    if (pt->stats.items)  ccm_da_deinit(&pt->stats);
+    if (pt->queued.items) ccm_da_deinit(&pt->queued);
+}
+
+// -----------------------------------------------------------------------------
+// [10] ChildProc
+// -----------------------------------------------------------------------------
+#ifdef CCM_STATS
+static s32 spawn_count = 0;
+#endif /* CCM_STATS */
+
+#if CCM_SPAWN == CCM_SPAWN_CLONE
+typedef struct {
+    c8 **argv;
+    s32 fd;
+    s32 err;
+} ccm_clone_args;
+
+/* runs on the parent's memory until execvp, so it only touches its own fds
+ * and reports a failed exec through args->err */
+__attribute__((no_sanitize("address")))
+s32 ccm_childproc_clone_main(void *arg)
+{
+    ccm_clone_args *args = arg;
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+    setpgid(0, 0);
+
+    dup2(args->fd, STDOUT_FILENO);
+    dup2(args->fd, STDERR_FILENO);
+
+    execvp(args->argv[0], (c8 *const*)args->argv);
+    args->err = errno;
+    _exit(127);
+}
+#endif /* CCM_SPAWN_CLONE */
+
+bool ccm_childproc_fork(ccm_childproc *cp)
+{
+    c8 *pathname = cp->cmd[0];
+    c8 **argv    = cp->cmd;
+    pid_t cpid   = -1;
+
+#ifdef CCM_STATS
+    ++spawn_count;
+#endif /* CCM_STATS */
+
+#if CCM_SPAWN == CCM_SPAWN_POSIX
+    /* the pipe fds are O_CLOEXEC, only the dup2'd copies survive the exec */
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t empty;
+    sigemptyset(&empty);
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, cp->pipe.write, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, cp->pipe.write, STDERR_FILENO);
+    posix_spawnattr_init(&attr);
+    /* the signalfd fallback blocks SIGCHLD, which exec would inherit */
+    posix_spawnattr_setsigmask(&attr, &empty);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+
+    s32 err = posix_spawnp(&cpid, pathname, &actions, &attr, argv, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        ccm_log(CCM_LOG_ERROR, "target [%s]: posix_spawn %s failed, %s\n",
+                cp->target->name, pathname, strerror(err));
+        return false;
+    }
+#elif CCM_SPAWN == CCM_SPAWN_CLONE
+    /* CLONE_VFORK suspends us until the child execs or exits,
+     * so one stack serves every spawn */
+    static _Alignas(16) u8 stack[CCM_CLONE_STACK_SIZE];
+    ccm_clone_args args = { .argv = argv, .fd = cp->pipe.write, .err = 0 };
+
+    cpid = clone(ccm_childproc_clone_main, stack + sizeof(stack),
+                 CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+    if (cpid == -1 || args.err != 0) {
+        ccm_log(CCM_LOG_ERROR, "target [%s]: clone %s failed, %s\n",
+                cp->target->name, pathname, strerror(cpid == -1 ? errno : args.err));
+        if (cpid != -1) waitpid(cpid, NULL, 0);
+        return false;
+    }
+#else
+    cpid = fork();
+    switch (cpid) {
+    case -1: {
+        ccm_log(CCM_LOG_ERROR, "target [%s]: fork failed, %s\n",
+                cp->target->name,
+                strerror(errno));
+        return false;
+    }
+    case 0: {
+        /* the signalfd fallback blocks SIGCHLD, which exec would inherit */
+        sigset_t empty;
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+        setpgid(0, 0);
+
+        close(cp->pipe.read);
+        dup2(cp->pipe.write, STDOUT_FILENO);
+        dup2(cp->pipe.write, STDERR_FILENO);
+        close(cp->pipe.write);
+
+        if (execvp(pathname, (c8 *const*)argv) < 0) {
+            ccm_log(CCM_LOG_ERROR, "execvp failed!\n");
+            exit(1);
+        }
+        ccm_unreachable();
+    }
+    }
+    /* the child does the same, whichever runs first wins the race with a kill */
+    setpgid(cpid, cpid);
+#endif /* CCM_SPAWN */
+
+    close(cp->pipe.write);
+    cp->pid = cpid;
+    cp->running = true;
+    return true;
+}
+
+/* CCM_OUTPUT_LOG_DIR/<target>.log, with the target path flattened, '/' and
+ * '%' are escaped as %2F and %25 so two targets never share a log */
+void ccm_childproc_log_path(ccm_childproc const *cp, c8 *path, lll size)
+{
+    c8 const *name = cp->target->name;
+    while (name[0] == '.' && name[1] == '/') name += 2;
+    lll len = snprintf(path, size, "%s/", CCM_OUTPUT_LOG_DIR);
+    for (; *name && len + 4 < size; ++name) {
+        if (*name == '/' || *name == '%') {
+            len += snprintf(path + len, size - len, "%%%02X", *name);
+        } else {
+            path[len++] = *name;
+        }
+    }
+    snprintf(path + len, size - len, ".log");
+}
+
+/* opened on the first byte that needs it, -2 after a failed open */
+bool ccm_childproc_log_open(ccm_childproc *cp)
+{
+    if (cp->log != -1) return cp->log >= 0;
+
+    c8 path[PATH_MAX];
+    ccm_childproc_log_path(cp, path, sizeof(path));
+    if (ccm_mkdir_parents(path)) {
+        cp->log = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (cp->log < 0) {
+        ccm_log(CCM_LOG_WARN, "log %s: %s, output of the job is dropped\n",
+                path, strerror(errno));
+        cp->log = -2;
+    }
+    return cp->log >= 0;
+}
+
+/* moves the buffered output to the log, the buffer itself never grows */
+void ccm_childproc_spill(ccm_childproc *cp)
+{
+    if (ccm_childproc_log_open(cp)) {
+        for (lll off = 0; off < cp->report.len; ) {
+            lll n = write(cp->log, cp->report.items + off, cp->report.len - off);
+            if (n == -1 && errno == EINTR) continue;
+            if (n == -1) {
+                ccm_log(CCM_LOG_ERROR, "write: log of %s failed: %s\n",
+                        cp->target->name, strerror(errno));
+                break;
+            }
+            off += n;
+        }
+    }
+    cp->logged += cp->report.len;
+    cp->report.len = 0;
+}
+
+/* writes all of `iov`, picking up after short writes */
+void ccm_childproc_writev(ccm_childproc *cp, struct iovec *iov, s32 niov)
+{
+    fflush(stdout);
+    while (niov > 0) {
+        lll n = writev(STDOUT_FILENO, iov, niov);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            ccm_log(CCM_LOG_ERROR, "writev: output of %s failed: %s\n",
+                    cp->target->name, strerror(errno));
+            return;
+        }
+        for (; niov > 0 && (lll)iov->iov_len <= n; ++iov, --niov) n -= iov->iov_len;
+        if (niov > 0) {
+            iov->iov_base = (c8 *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+/* prints the complete lines of the buffer with the target as prefix, the
+ * partial last line too with `all` */
+void ccm_childproc_stream(ccm_childproc *cp, bool all)
+{
+    c8 prefix[128];
+    s32 plen = snprintf(prefix, sizeof(prefix), "[%s] ", cp->target->name);
+    plen = ccm_s32_min(plen, sizeof(prefix) - 1);
+
+    struct iovec iov[3 * 32];
+    s32 niov = 0;
+    c8 *line = cp->report.items;
+    c8 *end  = cp->report.items + cp->report.len;
+    while (line < end) {
+        c8 *nl = memchr(line, '\n', end - line);
+        if (nl == NULL && !all) break;
+        c8 *next = nl ? nl + 1 : end;
+
+        iov[niov++] = (struct iovec){ prefix, plen };
+        iov[niov++] = (struct iovec){ line, next - line };
+        if (nl == NULL) iov[niov++] = (struct iovec){ "\n", 1 };
+        line = next;
+
+        if (niov > ccm_countof(iov) - 3) {
+            ccm_childproc_writev(cp, iov, niov);
+            niov = 0;
+        }
+    }
+    if (niov > 0) ccm_childproc_writev(cp, iov, niov);
+
+    cp->report.len = end - line;
+    memmove(cp->report.items, line, cp->report.len);
+}
+
+/* zero copy from the pipe into the log, false hands the bytes to read() */
+bool ccm_childproc_splice(ccm_childproc *cp)
+{
+    s32 avail = 0;
+    /* a job that prints nothing leaves no log behind */
+    if (cp->log == -1 && ioctl(cp->pipe.read, FIONREAD, &avail) == 0 && avail == 0) return true;
+    if (!ccm_childproc_log_open(cp)) return false;
+
+    for (;;) {
+        lll n = splice(cp->pipe.read, NULL, cp->log, NULL, 1 << 20,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            cp->logged += n;
+            continue;
+        }
+        if (n == 0) return true;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN) return true;
+        /* EINVAL, the filesystem of the log can't take a splice */
+        return false;
+    }
+}
+
+void ccm_childproc_read(ccm_childproc *cp)
+{
+    if (cp->output == CCM_OUTPUT_LOG && ccm_childproc_splice(cp)) return;
+
+    for (;;) {
+        if (cp->report.len == cp->report.cap) {
+            if (cp->output == CCM_OUTPUT_STREAM) ccm_childproc_stream(cp, true);
+            else ccm_childproc_spill(cp);
+        }
+        lll n = read(cp->pipe.read, cp->report.items + cp->report.len,
+                     cp->report.cap - cp->report.len);
+        if (n == 0) break;
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            if (errno != EAGAIN) {
+                ccm_log(CCM_LOG_ERROR, "read: child %d failed: %s\n",
+                        cp->pid, strerror(errno));
+            }
+            break;
+        }
+        cp->report.len += n;
+        if (cp->output == CCM_OUTPUT_STREAM) ccm_childproc_stream(cp, false);
+    }
+}
+
+void ccm_childproc_report(ccm_childproc *cp)
+{
+    bool failed = !WIFEXITED(cp->status) || WEXITSTATUS(cp->status) != EXIT_SUCCESS;
+
+    /* job output skips stdio, what ccm_log buffered so far goes out first */
+    fflush(stdout);
+    if (cp->output == CCM_OUTPUT_STREAM) {
+        ccm_childproc_stream(cp, true);
+    } else if (cp->logged == 0 && cp->output == CCM_OUTPUT_BUFFERED) {
+        write(STDOUT_FILENO, cp->report.items, cp->report.len);
+        cp->report.len = 0;
+    } else {
+        if (cp->report.len > 0) ccm_childproc_spill(cp);
+    }
+
+    if (cp->logged > 0 && cp->log >= 0) {
+        c8 path[PATH_MAX];
+        ccm_childproc_log_path(cp, path, sizeof(path));
+        if (cp->output == CCM_OUTPUT_BUFFERED || failed) {
+            /* the head has the first errors, the rest stays in the log */
+            s32 fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd >= 0) {
+                sendfile(STDOUT_FILENO, fd, NULL, CCM_CHILDPROC_REPORT_BUF_CAP);
+                close(fd);
+            }
+            if (cp->logged > CCM_CHILDPROC_REPORT_BUF_CAP) {
+                ccm_log(CCM_LOG_WARN, "output of [%s] cut at %d of %ld bytes, see %s\n",
+                        cp->target->name, CCM_CHILDPROC_REPORT_BUF_CAP, cp->logged, path);
+            }
+        } else {
+            ccm_log(CCM_LOG_INFO, "output: %ld bytes in %s\n", cp->logged, path);
+        }
+    }
+    if (cp->log >= 0) close(cp->log);
+    cp->log = -1;
+    cp->logged = 0;
+    ccm_sep(80);
+}
+
+
+// -----------------------------------------------------------------------------
+// Jobserver
+// -----------------------------------------------------------------------------
+/* our own open file for the read side, O_NONBLOCK on a shared one would
+ * break the make that handed it to us */
+s32 ccm_jobserver_reopen(s32 fd)
+{
+    c8 path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    return open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+bool ccm_jobserver_client(ccm_jobserver *js, c8 const *makeflags)
+{
+    if (makeflags == NULL) return false;
+
+    /* make honors the last one, --jobserver-fds is the pre 4.2 spelling */
+    c8 const *auth = NULL;
+    for (c8 const *p = makeflags; (p = strstr(p, "--jobserver-")); ++p) {
+        if (strncmp(p, "--jobserver-auth=", 17) == 0) auth = p + 17;
+        if (strncmp(p, "--jobserver-fds=", 16) == 0)  auth = p + 16;
+    }
+    if (auth == NULL) return false;
+
+    if (strncmp(auth, "fifo:", 5) == 0) {
+        c8 path[PATH_MAX];
+        s32 len = strcspn(auth + 5, " ");
+        snprintf(path, sizeof(path), "%.*s", len, auth + 5);
+        js->rfd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        js->wfd = js->rfd < 0 ? -1 : open(path, O_WRONLY | O_CLOEXEC);
+        js->fifo = true;
+    } else {
+        s32 r, w;
+        if (sscanf(auth, "%d,%d", &r, &w) != 2) return false;
+        /* fds are only passed to recipes make considers recursive */
+        if (fcntl(r, F_GETFD) < 0 || fcntl(w, F_GETFD) < 0) {
+            ccm_log(CCM_LOG_INFO, "jobserver: fds %d,%d are not open, "
+                    "mark the recipe with '+'\n", r, w);
+            return false;
+        }
+        js->rfd = ccm_jobserver_reopen(r);
+        js->wfd = w;
+    }
+
+    if (js->rfd < 0 || js->wfd < 0) {
+        ccm_log(CCM_LOG_ERROR, "jobserver: cannot open %.*s, %s\n",
+                (s32)strcspn(auth, " "), auth, strerror(errno));
+        if (js->rfd >= 0) close(js->rfd);
+        js->rfd = js->wfd = -1;
+        return false;
+    }
+    return true;
+}
+
+bool ccm_jobserver_server(ccm_jobserver *js, s32 j)
+{
+    /* no O_CLOEXEC, the children inherit the pipe through MAKEFLAGS */
+    if (pipe(js->pipe) < 0) {
+        ccm_log(CCM_LOG_ERROR, "jobserver: pipe failed, %s\n", strerror(errno));
+        js->pipe[0] = js->pipe[1] = -1;
+        return false;
+    }
+    for (s32 i = 0; i < j - 1; ++i) {
+        lll n;
+        while ((n = write(js->pipe[1], "+", 1)) == -1 && errno == EINTR);
+        if (n != 1) {
+            ccm_log(CCM_LOG_ERROR, "jobserver: cannot fill the pipe, %s\n", strerror(errno));
+            close(js->pipe[0]);
+            close(js->pipe[1]);
+            js->pipe[0] = js->pipe[1] = -1;
+            return false;
+        }
+    }
+
+    js->rfd = ccm_jobserver_reopen(js->pipe[0]);
+    js->wfd = js->pipe[1];
+
+    c8 const *old = getenv("MAKEFLAGS");
+    js->makeflags = old ? strdup(old) : NULL;
+
+    /* NOTE sized from the old flags, a cut here would drop --jobserver-auth */
+#define CCM_JOBSERVER_FLAGS(buf, cap) \
+    snprintf(buf, cap, "%s -j%d --jobserver-auth=%d,%d", old ? old : "", j, js->pipe[0], js->pipe[1])
+    lll cap = CCM_JOBSERVER_FLAGS(NULL, 0) + 1;
+    c8 *flags = malloc(cap);
+    if (flags == NULL) ccm_panic("jobserver: out of memory\n");
+    CCM_JOBSERVER_FLAGS(flags, cap);
+#undef CCM_JOBSERVER_FLAGS
+    setenv("MAKEFLAGS", flags, 1);
+    free(flags);
+    return true;
+}
+
+ccm_jobserver ccm_jobserver_init(s32 j, bool serve)
+{
+    ccm_jobserver js = {
+        .rfd = -1,
+        .wfd = -1,
+        .pipe = { -1, -1 },
+        .implicit = true,
+    };
+    if (ccm_jobserver_client(&js, getenv("MAKEFLAGS"))) {
+        ccm_log(CCM_LOG_INFO, "jobserver: sharing the job slots of the parent\n");
+    } else if (serve && j > 1 && ccm_jobserver_server(&js, j)) {
+        ccm_log(CCM_LOG_INFO, "jobserver: serving %d job slots\n", j);
+    }
+    return js;
+}
+
+void ccm_jobserver_deinit(ccm_jobserver *js)
+{
+    if (js->rfd >= 0) close(js->rfd);
+    if (js->fifo && js->wfd >= 0) close(js->wfd);
+    if (js->pipe[0] >= 0) {
+        close(js->pipe[0]);
+        close(js->pipe[1]);
+        if (js->makeflags) setenv("MAKEFLAGS", js->makeflags, 1);
+        else               unsetenv("MAKEFLAGS");
+        free(js->makeflags);
+    }
+    *js = (ccm_jobserver){ .rfd = -1, .wfd = -1, .pipe = { -1, -1 } };
+}
+
+/* a token byte, CCM_JOBSERVER_IMPLICIT or CCM_JOBSERVER_WAIT */
+s32 ccm_jobserver_acquire(ccm_jobserver *js)
+{
+    if (js->rfd < 0) return CCM_JOBSERVER_IMPLICIT;
+    if (js->implicit) {
+        js->implicit = false;
+        return CCM_JOBSERVER_IMPLICIT;
+    }
+
+    u8 token;
+    for (;;) {
+        lll n = read(js->rfd, &token, 1);
+        if (n == 1) return token;
+        if (n == -1 && errno == EINTR) continue;
+        return CCM_JOBSERVER_WAIT;
+    }
+}
+
+void ccm_jobserver_release(ccm_jobserver *js, s32 token)
+{
+    if (js->rfd < 0) return;
+    if (token == CCM_JOBSERVER_IMPLICIT) {
+        js->implicit = true;
+        return;
+    }
+
+    u8 c = token;
+    while (write(js->wfd, &c, 1) == -1 && errno == EINTR);
+}
+
+
+// -----------------------------------------------------------------------------
+// ChildProc Manager
+// -----------------------------------------------------------------------------
+void ccm_proc_mgr_watch(ccm_proc_mgr *pm, s32 fd, u64 data)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = data };
+    if (epoll_ctl(pm->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        ccm_panic("ccm_proc_mgr: epoll_ctl failed, %s\n", strerror(errno));
+    }
+}
+
+/* queue `slot` for the run loop, at most once per ccm_proc_mgr_pub_ev */
+void ccm_proc_mgr_post(ccm_proc_mgr *pm, s32 slot, ccm_event ev)
+{
+    if (pm->evs[slot] == 0) pm->ready[pm->nready++] = slot;
+    pm->evs[slot] |= ev;
+}
+
+/* wake the loop once a jobserver token can be read, only while we wait for one */
+void ccm_proc_mgr_arm_jobserver(ccm_proc_mgr *pm, bool armed)
+{
+    if (pm->js.armed == armed) return;
+    struct epoll_event ev = {
+        .events = armed ? EPOLLIN : 0,
+        .data.u64 = CCM_EPOLL_JOBSERVER,
+    };
+    epoll_ctl(pm->epfd, EPOLL_CTL_MOD, pm->js.rfd, &ev);
+    pm->js.armed = armed;
+}
+
+bool ccm_pool_full(ccm_pool const *p)
+{
+    return p && p->depth > 0 && p->nrunning >= p->depth;
+}
+
+/* the slots `t` takes, clamped so that every target fits an idle manager */
+s32 ccm_proc_mgr_slots(ccm_proc_mgr const *pm, ccm_target const *t)
+{
+    return t->slots < 1 ? 1 : t->slots > pm->maxjobs ? pm->maxjobs : t->slots;
+}
+
+/* whether `t` can start now, see ccm_pool */
+bool ccm_proc_mgr_fits(ccm_proc_mgr const *pm, ccm_target const *t)
+{
+    if (ccm_pool_full(t->pool)) return false;
+    if (pm->nrunning == 0) return true;
+    if (pm->nslots + ccm_proc_mgr_slots(pm, t) > pm->limit) return false;
+    lll budget = pm->spec->mem_budget_kb;
+    return budget <= 0 || pm->mem_kb + t->mem_est_kb <= budget;
+}
+
+/* "some avg10" of a PSI file, -1 if the kernel has no PSI */
+f64 ccm_psi_some(c8 const *path)
+{
+    c8 buf[256];
+    s32 fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    lll n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return -1;  /* EOPNOTSUPP with psi=0 on the command line */
+    buf[n] = 0;
+
+    f64 avg10;
+    return sscanf(buf, "some avg10=%lf", &avg10) == 1 ? avg10 : -1;
+}
+
+s32 ccm_online_cpus(void)
+{
+    /* a cpuset or taskset narrows what we may run on */
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) return CPU_COUNT(&set);
+    lll n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+ccm_load ccm_load_sample(void)
+{
+    ccm_load load = {
+        .memory  = ccm_psi_some(CCM_PSI_DIR "/memory"),
+        .cpu     = ccm_psi_some(CCM_PSI_DIR "/cpu"),
+        .loadavg = -1,
+    };
+    load.psi = load.memory >= 0 && load.cpu >= 0;
+
+    FILE *f = fopen(CCM_LOADAVG_PATH, "re");
+    if (f) {
+        if (fscanf(f, "%lf", &load.loadavg) != 1) load.loadavg = -1;
+        fclose(f);
+    }
+    return load;
+}
+
+/* moves pm->limit with the pressure on the machine, see ccm_load */
+void ccm_proc_mgr_adapt(ccm_proc_mgr *pm)
+{
+    s64 now = ccm_now_ns();
+    if (now - pm->adapted_ns < CCM_ADAPT_INTERVAL_MS * 1000000LL) return;
+    pm->adapted_ns = now;
+
+    ccm_load load = ccm_load_sample();
+    s32 limit = pm->limit;
+    if (load.psi) {
+        if (load.memory > CCM_PSI_MEMORY_HIGH) limit /= 2;
+        else if (load.cpu > CCM_PSI_CPU_HIGH) limit -= 1;
+        else limit += 1;
+    } else if (load.loadavg >= 0) {
+        /* what the rest of the machine keeps busy */
+        f64 others = load.loadavg - pm->nrunning;
+        s32 room = pm->maxjobs - (others > 0 ? (s32)(others + 0.5) : 0);
+        if (limit > room) limit -= 1;
+        else if (limit < room) limit += 1;
+    }
+    if (limit < 1) limit = 1;
+    if (limit > pm->maxjobs) limit = pm->maxjobs;
+    if (limit == pm->limit) return;
+
+    if (load.psi) {
+        ccm_log(CCM_LOG_INFO, "jobs: %d -> %d, memory %.2f%%, cpu %.2f%%\n",
+                pm->limit, limit, load.memory, load.cpu);
+    } else {
+        ccm_log(CCM_LOG_INFO, "jobs: %d -> %d, loadavg %.2f\n", pm->limit, limit, load.loadavg);
+    }
+    pm->limit = limit;
+}
+
+/* fails fast, nothing new is admitted and the running jobs get `sig` */
+void ccm_proc_mgr_stop(ccm_proc_mgr *pm, s32 sig)
+{
+    pm->stopping = true;
+    for (s32 i = 0; i < pm->maxjobs; ++i) {
+        ccm_childproc *cp = &pm->cps[i];
+        if (cp->target == NULL || !cp->running) continue;
+        kill(-cp->pid, sig);
+        cp->killed = true;
+    }
+}
+
+bool ccm_proc_mgr_add_target(ccm_proc_mgr *pm, ccm_target *t)
+{
+    if (!ccm_proc_mgr_fits(pm, t)) return false;
+
+    s32 token = ccm_jobserver_acquire(&pm->js);
+    if (token == CCM_JOBSERVER_WAIT) {
+        ccm_proc_mgr_arm_jobserver(pm, true);
+        return false;
+    }
+
+    s32 next_child = pm->free[--pm->nfree];
+    ccm_childproc *cp = &pm->cps[next_child];
+    ccm_spec *spec = pm->spec;
+
+    pm->evs[next_child] = 0;
+
+    t->start_ns = ccm_now_ns();
+    cp->target = t;
+    cp->cmd = ccm_target_command(spec, t);
+    /* hash the inputs before the job starts, edits made during the job must
+     * still show up as changes on the next build */
+    cp->inputs  = ccm_spec_content_checks(spec) ? ccm_target_inputs_hash(spec, t) : 0;
+    cp->depfile = t->depfile;
+    cp->pidfd   = -1;
+    cp->pid     = 0;
+    cp->running = false;
+    cp->killed  = false;
+    cp->token   = token;
+    cp->output  = spec->output;
+    if (cp->output == CCM_OUTPUT_LOG) {
+        /* the log is of the last run, also when that one was silent */
+        c8 path[PATH_MAX];
+        ccm_childproc_log_path(cp, path, sizeof(path));
+        unlink(path);
+    }
+    cp->cache_key = ccm_target_cache_key(spec, t, cp->cmd);
+    cp->cached  = cp->cache_key && ccm_cache_fetch(spec, t, cp->cache_key);
+
+    ++pm->nrunning;
+    pm->nslots += ccm_proc_mgr_slots(pm, t);
+    pm->mem_kb += t->mem_est_kb;
+    if (t->pool) ++t->pool->nrunning;
+
+    if (cp->cached) {
+        cp->pipe.read = -1;
+        cp->status = 0;
+        ccm_proc_mgr_post(pm, next_child, CCM_EVENT_WAIT_DONE);
+        return true;
+    }
+    /* the store may own the old output through a hardlink */
+    if (cp->cache_key) unlink(t->name);
+
+    /* O_CLOEXEC: no other job may hold this pipe open past its own child.
+     * Only our end is nonblocking, a child would drop output on EAGAIN */
+    if (pipe2((int*)&cp->pipe, O_CLOEXEC) < 0) {
+        ccm_panic("ccm_proc_mgr_add_target: pipe2 failed, %s\n", strerror(errno));
+    }
+    fcntl(cp->pipe.read, F_SETFL, O_NONBLOCK);
+
+    /* forks the child and sets up the pipe */
+    if (!ccm_childproc_fork(cp)) {
+        close(cp->pipe.read);
+        close(cp->pipe.write);
+        cp->pipe.read = -1;
+        cp->status = 127 << 8; /* reads back as a failed exit */
+        ccm_proc_mgr_post(pm, next_child, CCM_EVENT_WAIT_DONE);
+        return true;
+    }
+
+    ccm_proc_mgr_watch(pm, cp->pipe.read, (u64)next_child << 1);
+    if (pm->sigfd < 0) {
+        cp->pidfd = syscall(SYS_pidfd_open, cp->pid, 0);
+        if (cp->pidfd < 0) {
+            ccm_panic("ccm_proc_mgr_add_target: pidfd_open failed, %s\n", strerror(errno));
+        }
+        ccm_proc_mgr_watch(pm, cp->pidfd, (u64)next_child << 1 | 1);
+    }
+
+    return true;
+}
+
+/* like ccm_target_propagate_done, but leaves the freed dependents to the
+ * caller's own up-to-date check instead of queueing them for a rebuild */
+void ccm_target_propagate_uptodate(ccm_spec *spec, ccm_target const *t)
+{
+    ccm_graph *g = &spec->graph;
+    g->state[t->id] |= CCM_NODE_DONE;
+    for (u32 e = g->rev_off[t->id]; e < g->rev_off[t->id + 1]; ++e) {
+        --g->pending[g->rev_idx[e]];
+    }
+}
+
+/* skips every active target depending on the failed `t`, returns how many */
+s32 ccm_target_propagate_failed(ccm_spec *spec, ccm_target const *t)
+{
+    ccm_graph *g = &spec->graph;
+    s32 skipped = 0;
+    ccm_as_scratch_arena(spec->arena) {
+        u32 *stack = ccm_arena_alloc(u32, &spec->arena, g->n);
+        u32 len = 0;
+        stack[len++] = t->id;
+        while (len > 0) {
+            u32 i = stack[--len];
+            for (u32 e = g->rev_off[i]; e < g->rev_off[i + 1]; ++e) {
+                u32 r = g->rev_idx[e];
+                if (!(g->state[r] & CCM_NODE_ACTIVE) || (g->state[r] & CCM_NODE_SKIPPED)) continue;
+                g->state[r] |= CCM_NODE_SKIPPED;
+                ++skipped;
+                stack[len++] = r;
+            }
+        }
+    }
+    return skipped;
+}
+
+/* accounts a job that did not succeed, returns how many dependents it skipped */
+s32 ccm_proc_mgr_fail(ccm_proc_mgr *pm, ccm_childproc *cp)
+{
+    ccm_spec *spec = pm->spec;
+    ccm_target *t = cp->target;
+    if (cp->killed) {
+        /* a half written output must not pass for up to date on the next run */
+        unlink(t->name);
+        ++pm->ninterrupted;
+        spec->graph.state[t->id] |= CCM_NODE_INTERRUPTED;
+        ccm_log(CCM_LOG_WARN, "Target [%s] interrupted\n", t->name);
+        return ccm_target_propagate_failed(spec, t);
+    }
+
+    ++pm->nfailed;
+    spec->graph.state[t->id] |= CCM_NODE_FAILED;
+    if (WIFSIGNALED(cp->status)) {
+        ccm_log(CCM_LOG_ERROR, "Target [%s] killed by signal %d (%s)\n",
+                t->name, WTERMSIG(cp->status), strsignal(WTERMSIG(cp->status)));
+    } else {
+        ccm_log(CCM_LOG_ERROR, "Target [%s] failed with exit code %d\n",
+                t->name, WEXITSTATUS(cp->status));
+    }
+    s32 limit = spec->keep_going > 0 ? spec->keep_going : 1;
+    if (spec->keep_going >= 0 && pm->nfailed >= limit && !pm->stopping) {
+        ccm_log(CCM_LOG_ERROR, "stopping after %d failed jobs\n", pm->nfailed);
+        ccm_proc_mgr_stop(pm, SIGTERM);
+    }
+    return ccm_target_propagate_failed(spec, t);
+}
+
+/* NOTE
+ * Early cutoff. A dependent is only queued when one of its deps came out
+ * different (`changed`), otherwise it gets the up-to-date check of the sweep
+ * once its last dep is in. Targets that pass are cut off and release their own
+ * dependents the same way, the count of cut off targets is returned.
+ */
+s32 ccm_target_propagate_done(ccm_spec *spec, ccm_target *t, bool changed,
+                              ccm_prio_queue *ready_queue)
+{
+    /* not a scratch stack: ccm_target_command_changed memoizes rt->cmd in
+     * the arena, which must outlive this walk */
+    ccm_graph *g = &spec->graph;
+    u32 *stack = g->stack;
+    u32 len = 0;
+    s32 cutoff = 0;
+    stack[len++] = t->id;
+    while (len > 0) {
+        u32 done = stack[--len];
+        g->state[done] |= CCM_NODE_DONE;
+        for (u32 e = g->rev_off[done]; e < g->rev_off[done + 1]; ++e) {
+            u32 r = g->rev_idx[e];
+            ccm_target *rt = spec->deps.items[r];
+            /* deps finish in time order, the last one to get here gated `rt` */
+            rt->last_dep = spec->deps.items[done];
+            if (changed && done == t->id) g->state[r] |= CCM_NODE_STALE;
+            if (--g->pending[r] > 0) continue;
+
+            bool forced = (g->state[r] & CCM_NODE_STALE) || spec->db.header == NULL ||
+                ((g->state[r] & CCM_NODE_DIRTY) && spec->check != CCM_CHECK_HASH);
+            if (forced || ccm_target_command_changed(spec, rt) ||
+                ccm_target_needs_rebuild_hash(spec, rt)) {
+                ccm_pq_push(ready_queue, rt);
+                continue;
+            }
+            /* mtime checks must agree on the next run, rt is now newer than done */
+            if (spec->check == CCM_CHECK_MTIME) {
+                utimensat(AT_FDCWD, rt->name, NULL, 0);
+                ccm_path_forget(&spec->paths, rt->name);
+            }
+            ccm_log(CCM_LOG_INFO, "Target [%s] deps unchanged, skip rebuild\n", rt->name);
+            ccm_sep(80);
+            ++cutoff;
+            stack[len++] = r;
+        }
+    }
+    return cutoff;
+}
+
+// -----------------------------------------------------------------------------
+// Build Database
+// -----------------------------------------------------------------------------
+lll ccm_db_size(u64 cap)
+{
+    return sizeof(ccm_db_header) + cap * sizeof(ccm_db_record);
+}
+
+bool ccm_db_map(ccm_db *db, lll size)
+{
+    if (ftruncate(db->fd, size) < 0) {
+        ccm_log(CCM_LOG_ERROR, "db: ftruncate failed: %s\n", strerror(errno));
+        return false;
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, db->fd, 0);
+    if (p == MAP_FAILED) {
+        ccm_log(CCM_LOG_ERROR, "db: mmap failed: %s\n", strerror(errno));
+        return false;
+    }
+    db->size    = size;
+    db->header  = p;
+    db->records = (ccm_db_record *)(db->header + 1);
+    return true;
+}
+
+bool ccm_db_open(ccm_db *db, c8 const *path)
+{
+    *db = (ccm_db){ .fd = -1 };
+
+    if (!ccm_mkdir_parents(path)) return false;
+
+    db->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (db->fd < 0) {
+        ccm_log(CCM_LOG_ERROR, "db: open %s failed: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    /* two concurrent builds would corrupt each other's view of the table */
+    if (flock(db->fd, LOCK_EX | LOCK_NB) < 0) {
+        ccm_log(CCM_LOG_WARN, "db: %s is locked, waiting for the other build\n", path);
+        flock(db->fd, LOCK_EX);
+    }
+
+    struct stat st;
+    if (fstat(db->fd, &st) < 0) {
+        ccm_log(CCM_LOG_ERROR, "db: fstat %s failed: %s\n", path, strerror(errno));
+        ccm_db_close(db);
+        return false;
+    }
+
+    bool valid = false;
+    if (st.st_size >= (lll)sizeof(ccm_db_header)) {
+        if (!ccm_db_map(db, st.st_size)) {
+            ccm_db_close(db);
+            return false;
+        }
+        valid = db->header->magic == CCM_DB_MAGIC
+            && db->header->version == CCM_DB_VERSION
+            && db->header->cap != 0
+            && (db->header->cap & (db->header->cap - 1)) == 0
+            && ccm_db_size(db->header->cap) == st.st_size;
+        if (!valid) {
+            ccm_log(CCM_LOG_WARN, "db: %s is stale or corrupt, starting over\n", path);
+            munmap(db->header, db->size);
+        }
+    }
+
+    if (!valid) {
+        /* truncating first guarantees the fresh mapping reads back zeroed */
+        if (ftruncate(db->fd, 0) < 0 || !ccm_db_map(db, ccm_db_size(CCM_DB_INITIAL_CAP))) {
+            ccm_db_close(db);
+            return false;
+        }
+        db->header->magic   = CCM_DB_MAGIC;
+        db->header->version = CCM_DB_VERSION;
+        db->header->cap     = CCM_DB_INITIAL_CAP;
+        db->header->len     = 0;
+    }
+
+    return true;
+}
+
+void ccm_db_close(ccm_db *db)
+{
+    if (db->header) munmap(db->header, db->size);
+    if (db->fd >= 0) close(db->fd); /* also drops the lock */
+    *db = (ccm_db){ .fd = -1 };
+}
+
+ccm_db_record *ccm_db_probe(ccm_db_record *records, u64 cap, u64 key, u32 kind)
+{
+    u64 mask = cap - 1;
+    for (u64 i = key & mask;; i = (i + 1) & mask) {
+        if ((records[i].key == key && records[i].kind == kind) || records[i].key == 0) {
+            return &records[i];
+        }
+    }
+}
+
+/* the kind is mixed on its own first, as a seed it would only be xored into
+ * the first bytes of the name */
+u64 ccm_db_key(u32 kind, c8 const *name)
+{
+    u64 key = ccm_hash_combine(ccm_hash_combine(0, kind), ccm_hash_str8(name, 0));
+    return key == 0 ? 1 : key;
+}
+
+void ccm_db_grow(ccm_db *db)
+{
+    u64 old_cap = db->header->cap;
+    u64 new_cap = old_cap * 2;
+    lll nbytes  = old_cap * sizeof(ccm_db_record);
+
+    ccm_db_record *old = ccm_malloc(nbytes);
+    if (old == NULL) ccm_panic("db: grow: out of memory\n");
+    memcpy(old, db->records, nbytes);
+
+    munmap(db->header, db->size);
+    if (!ccm_db_map(db, ccm_db_size(new_cap))) {
+        ccm_panic("db: grow to %lu records failed\n", new_cap);
+    }
+    memset(db->records, 0, new_cap * sizeof(ccm_db_record));
+    db->header->cap = new_cap;
+
+    for (u64 i = 0; i < old_cap; ++i) {
+        if (old[i].key == 0) continue;
+        *ccm_db_probe(db->records, new_cap, old[i].key, old[i].kind) = old[i];
+    }
+    ccm_free(old);
+}
+
+ccm_db_record *ccm_db_get(ccm_db *db, u32 kind, c8 const *name)
+{
+    ccm_db_record *r = ccm_db_probe(db->records, db->header->cap, ccm_db_key(kind, name), kind);
+    return r->key == 0 ? NULL : r;
+}
+
+/* NOTE: may grow and remap the table, invalidating earlier records */
+ccm_db_record *ccm_db_put(ccm_db *db, u32 kind, c8 const *name)
+{
+    u64 key = ccm_db_key(kind, name);
+    ccm_db_record *r = ccm_db_probe(db->records, db->header->cap, key, kind);
+    if (r->key != 0) return r;
+
+    if (4 * (db->header->len + 1) > 3 * db->header->cap) {
+        ccm_db_grow(db);
+        r = ccm_db_probe(db->records, db->header->cap, key, kind);
+    }
+    ++db->header->len;
+    *r = (ccm_db_record){ .key = key, .kind = kind };
+    return r;
+}
+
+/* content hash of the file at `path`, 0 if it does not exist */
+u64 ccm_db_file_hash(ccm_db *db, c8 const *path)
+{
+    ccm_path_stat st;
+    if (!ccm_path_lookup(db->paths, path, &st)) return 0;
+
+    s64 mtime_ns = st.mtime_ns;
+    s64 ctime_ns = st.ctime_ns;
+
+    ccm_db_record *r = ccm_db_get(db, CCM_DB_FILE, path);
+    if (r && r->file.mtime_ns == mtime_ns && r->file.ctime_ns == ctime_ns &&
+        r->file.size == st.size && r->file.ino == st.ino) {
+        return r->file.hash;
+    }
+
+    u64 hash = ccm_hash64("", 0, CCM_DB_FILE);
+    if (st.size > 0) {
+        s32 fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return 0;
+        void *p = mmap(NULL, st.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            ccm_log(CCM_LOG_ERROR, "db: mmap %s failed: %s\n", path, strerror(errno));
+            return 0;
+        }
+        hash = ccm_hash64(p, st.size, CCM_DB_FILE);
+        munmap(p, st.size);
+    }
+    if (hash == 0) hash = 1; /* 0 is reserved for missing files */
+
+    r = ccm_db_put(db, CCM_DB_FILE, path);
+    r->file.mtime_ns = mtime_ns;
+    r->file.ctime_ns = ctime_ns;
+    r->file.size     = st.size;
+    r->file.ino      = st.ino;
+    r->file.hash     = hash;
+
+    return hash;
+}
+
+// -----------------------------------------------------------------------------
+// Dependency Log
+// -----------------------------------------------------------------------------
+#define CCM_DEPLOG_DEPS_BIT (1u << 31)
+
+bool ccm_deplog_write(ccm_deplog *log, u32 header, void const *payload, lll len)
+{
+    struct iovec iov[2] = {
+        { .iov_base = &header,         .iov_len = sizeof(header) },
+        { .iov_base = (void *)payload, .iov_len = len },
+    };
+    if (writev(log->fd, iov, 2) != (sw)(sizeof(header) + len)) {
+        ccm_log(CCM_LOG_ERROR, "deplog: write failed: %s\n", strerror(errno));
+        return false;
+    }
+    ++log->nrecords;
+    return true;
+}
+
+bool ccm_deplog_write_path(ccm_deplog *log, c8 const *path, u32 id)
+{
+    lll len    = strlen(path);
+    lll padded = (len + 4) & ~(lll)3; /* always leaves room for a NUL */
+    u32 check  = ~id;
+
+    c8 buf[PATH_MAX + 8] = {0};
+    if (padded + 4 > (lll)sizeof(buf)) return false;
+    memcpy(buf, path, len);
+    memcpy(buf + padded, &check, 4);
+
+    return ccm_deplog_write(log, padded + 4, buf, padded + 4);
+}
+
+bool ccm_deplog_write_deps(ccm_deplog *log, u32 out, ccm_deplog_entry const *e)
+{
+    lll len = (1 + e->len) * sizeof(u32);
+    u32 *buf = ccm_malloc(len);
+    if (buf == NULL) ccm_panic("deplog: out of memory\n");
+    buf[0] = out;
+    memcpy(buf + 1, e->ids, e->len * sizeof(u32));
+    bool ok = ccm_deplog_write(log, len | CCM_DEPLOG_DEPS_BIT, buf, len);
+    ccm_free(buf);
+    return ok;
+}
+
+u32 ccm_deplog_add_path(ccm_deplog *log, c8 const *path)
+{
+    u32 id = log->paths.len;
+    ccm_hmap_put(&log->lookup, ccm_hash_str8(path, 0), id);
+    ccm_da_append(&log->paths, path);
+    ccm_da_append(&log->deps, ((ccm_deplog_entry){0}));
+    return id;
+}
+
+/* parse the whole log, returns false when it has to be thrown away */
+bool ccm_deplog_load(ccm_deplog *log, lll size)
+{
+    lll off = sizeof(CCM_DEPLOG_MAGIC) + sizeof(u32);
+    u32 version = 0;
+    if (size < off) return size == 0;
+    if (memcmp(log->buf, CCM_DEPLOG_MAGIC, sizeof(CCM_DEPLOG_MAGIC)) != 0) return false;
+    memcpy(&version, log->buf + sizeof(CCM_DEPLOG_MAGIC), sizeof(u32));
+    if (version != CCM_DEPLOG_VERSION) return false;
+
+    while (off + (lll)sizeof(u32) <= size) {
+        u32 header;
+        memcpy(&header, log->buf + off, sizeof(u32));
+        lll len = header & ~CCM_DEPLOG_DEPS_BIT;
+        c8 *payload = log->buf + off + sizeof(u32);
+
+        /* a torn write at the tail from an interrupted build, drop it */
+        if (len % 4 != 0 || len < 4 || off + (lll)sizeof(u32) + len > size) break;
+
+        if (header & CCM_DEPLOG_DEPS_BIT) {
+            u32 const *ids = (u32 const *)payload;
+            lll n = len / sizeof(u32) - 1;
+            if (ids[0] >= log->paths.len) break;
+            bool valid = true;
+            for (lll i = 0; i < n; ++i) valid &= ids[1 + i] < log->paths.len;
+            if (!valid) break;
+            log->deps.items[ids[0]] = (ccm_deplog_entry){ .len = n, .ids = ids + 1 };
+        } else {
+            u32 check;
+            memcpy(&check, payload + len - 4, 4);
+            if (check != ~(u32)log->paths.len || payload[len - 5] != '\0') break;
+            ccm_deplog_add_path(log, payload);
+        }
+        ++log->nrecords;
+        off += sizeof(u32) + len;
+    }
+
+    if (off != size && ftruncate(log->fd, off) < 0) return false;
+    return true;
+}
+
+bool ccm_deplog_start(ccm_deplog *log)
+{
+    u32 version = CCM_DEPLOG_VERSION;
+    if (ftruncate(log->fd, 0) < 0 ||
+        write(log->fd, CCM_DEPLOG_MAGIC, sizeof(CCM_DEPLOG_MAGIC)) != sizeof(CCM_DEPLOG_MAGIC) ||
+        write(log->fd, &version, sizeof(version)) != sizeof(version)) {
+        ccm_log(CCM_LOG_ERROR, "deplog: write header failed: %s\n", strerror(errno));
+        return false;
+    }
+    log->nrecords = 0;
+    return true;
+}
+
+/* rewrite the log keeping only the paths still referenced by live records */
+bool ccm_deplog_recompact(ccm_deplog *log, c8 const *path)
+{
+    c8 tmp[PATH_MAX + 16];
+    snprintf(tmp, sizeof(tmp), "%s.recompact", path);
+
+    ccm_deplog next = { .arena = log->arena };
+    next.fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (next.fd < 0 || !ccm_deplog_start(&next)) {
+        if (next.fd >= 0) close(next.fd);
+        return false;
+    }
+
+    bool ok = true;
+    for (lll i = 0; ok && i < log->deps.len; ++i) {
+        ccm_deplog_entry const *e = &log->deps.items[i];
+        if (e->ids == NULL) continue;
+        ccm_str8_dynarray inputs = {0};
+        for (lll j = 0; j < e->len; ++j) ccm_da_append(&inputs, log->paths.items[e->ids[j]]);
+        ok = ccm_deplog_record(&next, log->paths.items[i], &inputs);
+        if (inputs.items) ccm_da_deinit(&inputs);
+    }
+
+    if (!ok || rename(tmp, path) < 0) {
+        ccm_log(CCM_LOG_ERROR, "deplog: recompact failed\n");
+        ccm_deplog_close(&next);
+        unlink(tmp);
+        return false;
+    }
+
+    /* everything in `next` was copied into the arena, the old buffer can go */
+    ccm_deplog_close(log);
+    *log = next;
+    return true;
+}
+
+bool ccm_deplog_open(ccm_deplog *log, c8 const *path, ccm_arena *arena)
+{
+    *log = (ccm_deplog){ .fd = -1, .arena = arena };
+    if (!ccm_mkdir_parents(path)) return false;
+
+    log->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat st;
+    if (log->fd < 0 || fstat(log->fd, &st) < 0) {
+        ccm_log(CCM_LOG_ERROR, "deplog: open %s failed: %s\n", path, strerror(errno));
+        ccm_deplog_close(log);
+        return false;
+    }
+
+    log->buf = ccm_malloc(st.st_size + 1);
+    if (log->buf == NULL) ccm_panic("deplog: out of memory\n");
+    if (pread(log->fd, log->buf, st.st_size, 0) != st.st_size ||
+        !ccm_deplog_load(log, st.st_size)) {
+        ccm_log(CCM_LOG_WARN, "deplog: %s is stale or corrupt, starting over\n", path);
+        ccm_deplog_close(log);
+        *log = (ccm_deplog){ .fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC), .arena = arena };
+        if (log->fd < 0) return false;
+    }
+
+    if (log->nrecords == 0) return ccm_deplog_start(log);
+
+    lll live = 0;
+    for (lll i = 0; i < log->deps.len; ++i) live += log->deps.items[i].ids != NULL;
+    if (log->nrecords > 3 * (log->paths.len + live) + 1000) {
+        ccm_deplog_recompact(log, path);
+    }
+    return true;
+}
+
+void ccm_deplog_close(ccm_deplog *log)
+{
+    if (log->fd >= 0) close(log->fd);
+    if (log->paths.items) ccm_da_deinit(&log->paths);
+    if (log->deps.items) ccm_da_deinit(&log->deps);
+    ccm_hmap_deinit(&log->lookup);
+    ccm_free(log->buf);
+    *log = (ccm_deplog){ .fd = -1 };
+}
+
+ccm_deplog_entry const *ccm_deplog_get(ccm_deplog const *log, c8 const *output)
+{
+    u32 id;
+    if (log->fd < 0 || !ccm_hmap_get(&log->lookup, ccm_hash_str8(output, 0), &id)) {
+        return NULL;
+    }
+    return log->deps.items[id].ids ? &log->deps.items[id] : NULL;
+}
+
+u32 ccm_deplog_path_id(ccm_deplog *log, c8 const *path, bool *ok)
+{
+    u32 id;
+    if (ccm_hmap_get(&log->lookup, ccm_hash_str8(path, 0), &id)) return id;
+
+    c8 *copy = ccm_fmt(log->arena, "%s", path);
+    id = ccm_deplog_add_path(log, copy);
+    *ok = *ok && ccm_deplog_write_path(log, copy, id);
+    return id;
+}
+
+/* returns whether the recorded inputs of `output` changed */
+bool ccm_deplog_record(ccm_deplog *log, c8 const *output, ccm_str8_dynarray const *inputs)
+{
+    bool ok = true;
+    u32 out = ccm_deplog_path_id(log, output, &ok);
+
+    u32 *ids = ccm_arena_alloc(u32, log->arena, inputs->len);
+    for (lll i = 0; i < inputs->len; ++i) {
+        ids[i] = ccm_deplog_path_id(log, inputs->items[i], &ok);
+    }
+
+    ccm_deplog_entry *e = &log->deps.items[out];
+    if (e->ids && e->len == inputs->len && memcmp(e->ids, ids, e->len * sizeof(u32)) == 0) {
+        return false;
+    }
+
+    *e = (ccm_deplog_entry){ .len = inputs->len, .ids = ids };
+    if (ok) ccm_deplog_write_deps(log, out, e);
+    return true;
+}
+
+/* parse the Makefile style `depfile` written by -MMD -MF and log its inputs */
+bool ccm_deplog_ingest(ccm_deplog *log, c8 const *output, c8 const *depfile)
+{
+    s32 fd = open(depfile, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        ccm_log(CCM_LOG_WARN, "Target [%s]: missing depfile %s\n", output, depfile);
+        return false;
+    }
+
+    c8 *buf = ccm_malloc(st.st_size + 1);
+    if (buf == NULL) ccm_panic("deplog: out of memory\n");
+    lll len = read(fd, buf, st.st_size);
+    close(fd);
+    len = len < 0 ? 0 : len;
+    buf[len] = '\0';
+
+    /* unescaped names land in `names`, never longer than the input */
+    c8 *names = ccm_malloc(len + 1);
+    if (names == NULL) ccm_panic("deplog: out of memory\n");
+
+    ccm_str8_dynarray inputs = {0};
+    bool in_rule = false;
+    c8 *w = names;
+
+    for (c8 const *r = buf; *r;) {
+        if (*r == ' ' || *r == '\t' || *r == '\r') { ++r; continue; }
+        if (*r == '\\' && (r[1] == '\n' || (r[1] == '\r' && r[2] == '\n'))) {
+            r += r[1] == '\n' ? 2 : 3;
+            continue;
+        }
+        if (*r == '\n') {
+            /* only the first rule matters, -MMD without -MP writes just one */
+            if (in_rule) break;
+            ++r;
+            continue;
+        }
+
+        c8 *name = w;
+        while (*r && *r != ' ' && *r != '\t' && *r != '\n' && *r != '\r') {
+            if (*r == '\\' && (r[1] == ' ' || r[1] == '#' || r[1] == '\\')) {
+                *w++ = r[1];
+                r += 2;
+            } else if (*r == '\\' && (r[1] == '\n' || r[1] == '\r')) {
+                break;
+            } else if (*r == '$' && r[1] == '$') {
+                *w++ = '$';
+                r += 2;
+            } else {
+                *w++ = *r++;
+            }
+        }
+
+        bool is_target = !in_rule && w > name && w[-1] == ':';
+        if (is_target) --w;
+        *w++ = '\0';
+
+        if (is_target) {
+            in_rule = true;
+        } else if (in_rule && name[0]) {
+            ccm_da_append(&inputs, name);
+        }
+    }
+
+    bool changed = ccm_deplog_record(log, output, &inputs);
+    if (inputs.items) ccm_da_deinit(&inputs);
+    ccm_free(names);
+    ccm_free(buf);
+    unlink(depfile);
+    return changed;
+}
+
+// -----------------------------------------------------------------------------
+// Compilation Cache
+// -----------------------------------------------------------------------------
+/* path, size and mtime of the compiler binary, the way ccache checks it */
+u64 ccm_cache_compiler_id(c8 const *compiler)
+{
+    c8 path[PATH_MAX];
+    struct stat st;
+    bool found = false;
+
+    if (strchr(compiler, '/')) {
+        snprintf(path, sizeof(path), "%s", compiler);
+        found = stat(path, &st) == 0;
+    } else {
+        c8 const *dirs = getenv("PATH");
+        for (c8 const *d = dirs ? dirs : "/usr/bin:/bin"; *d && !found;) {
+            s32 len = strcspn(d, ":");
+            snprintf(path, sizeof(path), "%.*s/%s", len, d, compiler);
+            found = stat(path, &st) == 0 && S_ISREG(st.st_mode);
+            d += len + (d[len] == ':');
+        }
+    }
+    if (!found) return 0;
+
+    u64 h = ccm_hash_str8(path, 0);
+    h = ccm_hash_combine(h, st.st_size);
+    return ccm_hash_combine(h, ccm_timespec_ns(st.st_mtim));
+}
+
+bool ccm_cache_open(ccm_cache *c, c8 *dir, lll max_bytes, c8 const *compiler)
+{
+    c8 cwd[PATH_MAX];
+    c8 path[PATH_MAX];
+
+    *c = (ccm_cache){
+        .dir = dir,
+        .max_bytes = max_bytes > 0 ? max_bytes : CCM_CACHE_MAX_BYTES,
+        .compiler = ccm_cache_compiler_id(compiler),
+    };
+    if (c->compiler == 0) {
+        ccm_log(CCM_LOG_WARN, "cache: compiler %s not found\n", compiler);
+        return false;
+    }
+    /* debug info embeds the working directory */
+    if (getcwd(cwd, sizeof(cwd)) == NULL) return false;
+    c->cwd = ccm_hash_str8(cwd, 0);
+
+    snprintf(path, sizeof(path), "%s/o/", dir);
+    if (!ccm_mkdir_parents(path)) return false;
+    snprintf(path, sizeof(path), "%s/m/", dir);
+    return ccm_mkdir_parents(path);
+}
+
+void ccm_cache_path(ccm_cache const *c, c8 *buf, c8 kind, u64 key)
+{
+    snprintf(buf, PATH_MAX, "%s/%c/%016lx", c->dir, kind, key);
+}
+
+/* hardlink, else reflink, else copy `from` to a fresh file at `to` */
+bool ccm_cache_clone(c8 const *from, c8 const *to)
+{
+    unlink(to);
+    if (link(from, to) == 0) return true;
+
+    s32 in = open(from, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return false;
+    s32 out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0755);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+
+    bool ok = ioctl(out, FICLONE, in) == 0;
+    if (!ok) {
+        struct stat st;
+        ok = fstat(in, &st) == 0;
+        for (lll left = ok ? st.st_size : 0; ok && left > 0;) {
+            lll n = copy_file_range(in, NULL, out, NULL, left, 0);
+            ok = n > 0;
+            left -= n;
+        }
+    }
+    close(in);
+    close(out);
+    if (!ok) unlink(to);
+    return ok;
+}
+
+/* the full key, primary plus the inputs listed in the manifest, 0 without one */
+u64 ccm_cache_manifest_key(ccm_spec *spec, u64 primary, ccm_str8_dynarray *inputs,
+                           c8 **buf)
+{
+    c8 path[PATH_MAX];
+    ccm_cache_path(&spec->cache, path, 'm', primary);
+
+    s32 fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    *buf = ccm_malloc(st.st_size + 1);
+    if (*buf == NULL) ccm_panic("cache: out of memory\n");
+    lll len = read(fd, *buf, st.st_size);
+    close(fd);
+    (*buf)[len < 0 ? 0 : len] = '\0';
+
+    u64 key = primary;
+    for (c8 *line = strtok(*buf, "\n"); line; line = strtok(NULL, "\n")) {
+        u64 h = ccm_db_file_hash(&spec->db, line);
+        if (h == 0) return 0; /* an input is gone, the manifest is stale */
+        key = ccm_hash_combine(key, h);
+        ccm_da_append(inputs, line);
+    }
+    return key;
+}
+
+bool ccm_cache_fetch(ccm_spec *spec, ccm_target const *t, u64 primary)
+{
+    ccm_cache *c = &spec->cache;
+    ccm_str8_dynarray inputs = {0};
+    c8 *buf = NULL;
+    bool hit = false;
+
+    u64 key = ccm_cache_manifest_key(spec, primary, &inputs, &buf);
+    if (key != 0) {
+        c8 path[PATH_MAX];
+        ccm_cache_path(c, path, 'o', key);
+        hit = access(path, F_OK) == 0 && ccm_mkdir_parents(t->name) &&
+              ccm_cache_clone(path, t->name);
+    }
+    if (hit) {
+        /* a fresh mtime keeps mtime checks happy and marks the entry as used */
+        utimensat(AT_FDCWD, t->name, NULL, 0);
+        ccm_deplog_record(&spec->deplog, t->name, &inputs);
+        ++c->hits;
+    } else {
+        ++c->misses;
+    }
+
+    if (inputs.items) ccm_da_deinit(&inputs);
+    ccm_free(buf);
+    return hit;
+}
+
+void ccm_cache_store(ccm_spec *spec, ccm_target const *t, u64 primary)
+{
+    ccm_cache *c = &spec->cache;
+    ccm_deplog_entry const *e = ccm_deplog_get(&spec->deplog, t->name);
+    if (e == NULL) return;
+
+    c8 path[PATH_MAX];
+    c8 tmp[PATH_MAX + 16];
+    u64 key = primary;
+    FILE *m = NULL;
+
+    ccm_cache_path(c, path, 'm', primary);
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    if ((m = fopen(tmp, "w")) == NULL) return;
+    for (lll i = 0; i < e->len; ++i) {
+        c8 const *input = spec->deplog.paths.items[e->ids[i]];
+        key = ccm_hash_combine(key, ccm_db_file_hash(&spec->db, input));
+        fprintf(m, "%s\n", input);
+    }
+    if (fclose(m) != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return;
+    }
+
+    /* write then rename, readers never see a partial entry */
+    ccm_cache_path(c, path, 'o', key);
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    if (ccm_cache_clone(t->name, tmp) && rename(tmp, path) == 0) {
+        ++c->stores;
+    } else {
+        unlink(tmp);
+    }
+}
+
+typedef struct {
+    s64 mtime_ns;
+    lll size;
+    c8  path[];
+} ccm_cache_entry;
+
+s32 ccm_cache_entry_older(void const *a, void const *b)
+{
+    s64 x = (*(ccm_cache_entry *const *)a)->mtime_ns;
+    s64 y = (*(ccm_cache_entry *const *)b)->mtime_ns;
+    return (x > y) - (x < y);
+}
+
+/* evict the least recently used entries until the store is 90% of max_bytes */
+void ccm_cache_trim(ccm_cache *c)
+{
+    struct { lll cap; lll len; ccm_cache_entry **items; } entries = {0};
+    lll total = 0;
+
+    for (c8 const *sub = "om"; *sub; ++sub) {
+        c8 dirpath[PATH_MAX];
+        snprintf(dirpath, sizeof(dirpath), "%s/%c", c->dir, *sub);
+        DIR *d = opendir(dirpath);
+        if (d == NULL) continue;
+
+        for (struct dirent *de; (de = readdir(d));) {
+            if (de->d_name[0] == '.') continue;
+            c8 path[PATH_MAX + sizeof(de->d_name)];
+            struct stat st;
+            snprintf(path, sizeof(path), "%s/%s", dirpath, de->d_name);
+            if (stat(path, &st) < 0) continue;
+
+            ccm_cache_entry *e = ccm_malloc(sizeof(*e) + strlen(path) + 1);
+            if (e == NULL) ccm_panic("cache: out of memory\n");
+            e->mtime_ns = ccm_timespec_ns(st.st_mtim);
+            e->size = st.st_blocks * 512;
+            strcpy(e->path, path);
+            ccm_da_append(&entries, e);
+            total += e->size;
+        }
+        closedir(d);
+    }
+
+    if (total > c->max_bytes) {
+        lll target = c->max_bytes / 10 * 9;
+        s32 evicted = 0;
+        qsort(entries.items, entries.len, sizeof(*entries.items), ccm_cache_entry_older);
+        for (lll i = 0; i < entries.len && total > target; ++i) {
+            if (unlink(entries.items[i]->path) == 0) {
+                total -= entries.items[i]->size;
+                ++evicted;
+            }
+        }
+        ccm_log(CCM_LOG_INFO, "cache: evicted %d entries, %ld bytes left\n", evicted, total);
+    }
+
+    for (lll i = 0; i < entries.len; ++i) ccm_free(entries.items[i]);
+    if (entries.items) ccm_da_deinit(&entries);
+}
+
+// -----------------------------------------------------------------------------
+// Build Trace
+// -----------------------------------------------------------------------------
+/* 0 when tracing is off, so disabled spans do not even read the clock */
+s64 ccm_trace_begin(ccm_trace const *tr)
+{
+    return tr->on ? ccm_now_ns() : 0;
+}
+
+void ccm_trace_end(ccm_trace *tr, c8 const *name, s64 start_ns)
+{
+    if (!tr->on) return;
+    ccm_da_append(&tr->events, ((ccm_trace_event){
+        .name = name, .cat = "driver", .start_ns = start_ns, .end_ns = ccm_now_ns(),
+    }));
+}
+
+void ccm_trace_job(ccm_trace *tr, ccm_target const *t, s32 lane, s32 pid, s32 status)
+{
+    if (!tr->on) return;
+    tr->lanes = ccm_s32_max(tr->lanes, lane);
+    ccm_da_append(&tr->events, ((ccm_trace_event){
+        .name = t->name, .cat = "job", .start_ns = t->start_ns, .end_ns = t->end_ns,
+        .tid = lane, .pid = pid, .status = status,
+    }));
+}
+
+void ccm_trace_puts(FILE *f, c8 const *s)
+{
+    fputc('"', f);
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\')  fprintf(f, "\\%c", *s);
+        else if ((u8)*s < 0x20)       fprintf(f, "\\u%04x", *s);
+        else                          fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+/* writes the events recorded so far and starts over */
+bool ccm_trace_write(ccm_trace *tr, c8 const *path)
+{
+    if (!tr->on) return true;
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        ccm_log(CCM_LOG_ERROR, "trace: cannot open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    s64 origin = 0;
+    for (lll i = 0; i < tr->events.len; ++i) {
+        s64 start = tr->events.items[i].start_ns;
+        if (origin == 0 || start < origin) origin = start;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+            "\"args\":{\"name\":\"driver\"}}");
+    for (s32 lane = 1; lane <= tr->lanes; ++lane) {
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":\"job %d\"}}", lane, lane);
+    }
+    for (lll i = 0; i < tr->events.len; ++i) {
+        ccm_trace_event const *e = &tr->events.items[i];
+        fprintf(f, ",\n{\"name\":");
+        ccm_trace_puts(f, e->name);
+        fprintf(f, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d",
+                e->cat, (e->start_ns - origin) / 1e3, (e->end_ns - e->start_ns) / 1e3, e->tid);
+        if (e->pid) fprintf(f, ",\"args\":{\"pid\":%d,\"status\":%d}", e->pid, e->status);
+        fputc('}', f);
+    }
+    fprintf(f, "\n]}\n");
+
+    tr->events.len = 0;
+    bool ok = fclose(f) == 0;
+    if (ok) ccm_log(CCM_LOG_INFO, "trace: %s\n", path);
+    return ok;
+}
+
+// -----------------------------------------------------------------------------
+// Manifest
+// -----------------------------------------------------------------------------
+/* points the arrays of `mf` into `base` and returns the offset of the pool,
+ * a NULL `base` only measures */
+u64 ccm_manifest_layout(ccm_manifest *mf, u8 *base, u32 n, u32 m)
+{
+    u64 at = sizeof(ccm_manifest_header);
+    u64 command = at; at += (u64)n * sizeof(u64);
+    u64 order   = at; at += (u64)n * sizeof(u32);
+    u64 level   = at; at += (u64)n * sizeof(s32);
+    u64 dep_off = at; at += ((u64)n + 1) * sizeof(u32);
+    u64 dep_idx = at; at += (u64)m * sizeof(u32);
+    u64 rev_off = at; at += ((u64)n + 1) * sizeof(u32);
+    u64 rev_idx = at; at += (u64)m * sizeof(u32);
+    u64 argc    = at; at += (u64)n * sizeof(u32);
+    u64 argv    = at; at += (u64)n * sizeof(u32);
+    u64 depfile = at; at += (u64)n * sizeof(u32);
+    if (base == NULL) return at;
+
+    mf->header  = (ccm_manifest_header *)base;
+    mf->command = (u64 *)(base + command);
+    mf->order   = (u32 *)(base + order);
+    mf->level   = (s32 *)(base + level);
+    mf->dep_off = (u32 *)(base + dep_off);
+    mf->dep_idx = (u32 *)(base + dep_idx);
+    mf->rev_off = (u32 *)(base + rev_off);
+    mf->rev_idx = (u32 *)(base + rev_idx);
+    mf->argc    = (u32 *)(base + argc);
+    mf->argv    = (u32 *)(base + argv);
+    mf->depfile = (u32 *)(base + depfile);
+    mf->pool    = (c8 *)(base + at);
+    return at;
+}
+
+/* every index and offset of a mapped manifest stays inside it, a corrupt one
+ * with a matching key must not read past the mapping */
+bool ccm_manifest_check(ccm_manifest const *mf, u64 pool_len)
+{
+    u32 n = mf->header->n;
+    u32 m = mf->header->m;
+    if (mf->dep_off[0] != 0 || mf->dep_off[n] != m) return false;
+    if (mf->rev_off[0] != 0 || mf->rev_off[n] != m) return false;
+    for (u32 i = 0; i < n; ++i) {
+        if (mf->order[i] >= n) return false;
+        if (mf->dep_off[i] > mf->dep_off[i + 1]) return false;
+        if (mf->rev_off[i] > mf->rev_off[i + 1]) return false;
+    }
+    for (u32 e = 0; e < m; ++e) {
+        if (mf->dep_idx[e] >= n || mf->rev_idx[e] >= n) return false;
+    }
+
+    /* the pool ends with a NUL, so only the string counts can run off it */
+    for (u32 i = 0; i < n; ++i) {
+        if (mf->depfile[i] >= pool_len) return false;
+        u64 at = mf->argv[i];
+        for (u32 k = 0; k < mf->argc[i]; ++k) {
+            if (at >= pool_len) return false;
+            at += strlen(mf->pool + at) + 1;
+        }
+    }
+    return true;
+}
+
+/* maps the manifest read-only if it was written for `key` */
+bool ccm_manifest_load(ccm_manifest *mf, u64 key)
+{
+    s32 fd = open(mf->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    u8 *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > (lll)sizeof(ccm_manifest_header)) {
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) return false;
+
+    ccm_manifest_header const *h = (ccm_manifest_header const *)base;
+    bool valid = h->magic == CCM_MANIFEST_MAGIC
+        && h->version == CCM_MANIFEST_VERSION
+        && h->key == key
+        && h->size == (u64)st.st_size
+        && ccm_manifest_layout(NULL, NULL, h->n, h->m) < h->size
+        && base[h->size - 1] == '\0';
+    ccm_manifest mapped = { .path = mf->path };
+    if (valid) {
+        u64 pool = ccm_manifest_layout(&mapped, base, h->n, h->m);
+        valid = ccm_manifest_check(&mapped, h->size - pool);
+        if (!valid) ccm_log(CCM_LOG_WARN, "manifest: %s is corrupt, rescheduling\n", mf->path);
+    }
+    if (!valid) {
+        munmap(base, st.st_size);
+        return false;
+    }
+    *mf = mapped;
+    return true;
+}
+
+/* NOTE
+ * Called on the run that had to schedule, every argv is built here instead of
+ * on demand. Written next to the old one and renamed over it, a build that
+ * still maps the old manifest keeps reading it.
+ */
+bool ccm_manifest_write(ccm_spec *spec, u64 key)
+{
+    ccm_graph const *g = &spec->graph;
+    c8 const *path = spec->manifest.path;
+    u32 n = g->n;
+    u32 m = g->dep_off[n];
+
+    u64 strings = 1;
+    for (u32 i = 0; i < n; ++i) {
+        ccm_target *t = spec->deps.items[i];
+        c8 **cmd = ccm_target_command(spec, t);
+        for (s32 k = 0; cmd[k]; ++k) strings += strlen(cmd[k]) + 1;
+        if (t->depfile) strings += strlen(t->depfile) + 1;
+    }
+
+    bool ok = false;
+    ccm_as_scratch_arena(spec->arena) {
+        u64 size = ccm_manifest_layout(NULL, NULL, n, m) + strings;
+        u8 *buf = ccm_arena_alloc(u8, &spec->arena, size);
+        ccm_manifest out;
+        ccm_manifest_layout(&out, buf, n, m);
+
+        *out.header = (ccm_manifest_header){
+            .magic   = CCM_MANIFEST_MAGIC,
+            .version = CCM_MANIFEST_VERSION,
+            .key     = key,
+            .size    = size,
+            .n       = n,
+            .m       = m,
+        };
+        memcpy(out.order,   g->order,   n * sizeof(u32));
+        memcpy(out.level,   g->level,   n * sizeof(s32));
+        memcpy(out.dep_off, g->dep_off, (n + 1) * sizeof(u32));
+        memcpy(out.dep_idx, g->dep_idx, m * sizeof(u32));
+        memcpy(out.rev_off, g->rev_off, (n + 1) * sizeof(u32));
+        memcpy(out.rev_idx, g->rev_idx, m * sizeof(u32));
+
+        c8 *p = out.pool;
+        *p++ = '\0';
+        for (u32 i = 0; i < n; ++i) {
+            ccm_target const *t = spec->deps.items[i];
+            out.command[i] = ccm_command_hash(t->cmd);
+            out.argv[i] = p - out.pool;
+            out.argc[i] = 0;
+            for (s32 k = 0; t->cmd[k]; ++k, ++out.argc[i]) p = stpcpy(p, t->cmd[k]) + 1;
+            out.depfile[i] = t->depfile ? p - out.pool : 0;
+            if (t->depfile) p = stpcpy(p, t->depfile) + 1;
+        }
+
+        c8 tmp[PATH_MAX + 16];
+        snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+        s32 fd = ccm_mkdir_parents(path) ?
+            open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+        if (fd >= 0) {
+            lll done = 0;
+            while (done < (lll)size) {
+                lll w = write(fd, buf + done, size - done);
+                if (w < 0 && errno == EINTR) continue;
+                if (w <= 0) break;
+                done += w;
+            }
+            ok = close(fd) == 0 && done == (lll)size;
+            ok = ok && rename(tmp, path) == 0;
+            if (!ok) unlink(tmp);
+        }
+        if (!ok) ccm_log(CCM_LOG_WARN, "manifest: writing %s failed: %s\n", path, strerror(errno));
+    }
+    return ok;
+}
+
+void ccm_manifest_close(ccm_manifest *mf)
+{
+    if (mf->header) munmap(mf->header, mf->header->size);
+    *mf = (ccm_manifest){ .path = mf->path };
+}
+
+// -----------------------------------------------------------------------------
+// Core
+// -----------------------------------------------------------------------------
+
+#ifdef CCM_STATS
+void ccm_stats(void)
+{
+    ccm_log(CCM_LOG_DEBUG, "CCM_STATS: spawn_count = %d\n", spawn_count);
+    ccm_log(CCM_LOG_DEBUG, "CCM_STATS: stat_count = %d\n", stat_count);
+}
+#endif /* CCM_STATS */
+
+
+s64 ccm_target_mtime(ccm_path_table *pt, ccm_target *t)
+{
+    if (t->mtime_ns == 0) {
+        ccm_path_stat st;
+        ccm_path_lookup(pt, t->name, &st);
+        t->mtime_ns = st.mtime_ns;
+    }
+    return t->mtime_ns;
+}
+
+/* `pt` holds the metadata of the run, NULL stats every path */
+bool ccm_target_needs_rebuild(ccm_path_table *pt, ccm_target *t)
+{
+    ccm_path_stat src;
+
+    s64 output_ns = ccm_target_mtime(pt, t);
+    if (output_ns < 0) {
+        return true;
+    }
+    s64 output_mtime = output_ns / 1000000000ll;
+
+    for (s32 i = 0; i < t->sources.len; ++i) {
+        if (ccm_path_lookup(pt, t->sources.items[i], &src) &&
+            output_mtime < src.mtime_ns / 1000000000ll) {
+            return true;
+        }
+    }
+
+    for (s32 i = 0; i < t->watch.len; ++i) {
+        if (ccm_path_lookup(pt, t->watch.items[i], &src) &&
+            output_mtime < src.mtime_ns / 1000000000ll) {
+            return true;
+        }
+    }
+
+    /* NOTE
+     * Dependency outputs are inputs too, a dep rebuilt by hand or by an
+     * interrupted run is newer than us even though the sweep finds the dep
+     * itself up to date. ccm wrote both, so the full resolution is safe here.
+     */
+    for (s32 i = 0; i < t->deps.len; ++i) {
+        if (ccm_target_mtime(pt, t->deps.items[i]) > output_ns) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+u64 ccm_target_inputs_hash(ccm_spec *spec, ccm_target const *t)
+{
+    ccm_db *db = &spec->db;
+    u64 h = ccm_hash_str8(t->name, CCM_DB_TARGET);
+    for (s32 i = 0; i < t->sources.len; ++i) {
+        h = ccm_hash_combine(h, ccm_db_file_hash(db, t->sources.items[i]));
+    }
+    for (s32 i = 0; i < t->watch.len; ++i) {
+        h = ccm_hash_combine(h, ccm_db_file_hash(db, t->watch.items[i]));
+    }
+    for (s32 i = 0; i < t->deps.len; ++i) {
+        h = ccm_hash_combine(h, ccm_db_file_hash(db, t->deps.items[i]->name));
+    }
+
+    ccm_deplog_entry const *e = ccm_deplog_get(&spec->deplog, t->name);
+    for (lll i = 0; e && i < e->len; ++i) {
+        h = ccm_hash_combine(h, ccm_db_file_hash(db, spec->deplog.paths.items[e->ids[i]]));
+    }
+    return h;
+}
+
+/* the primary cache key of `t`, 0 if it cannot be cached */
+u64 ccm_target_cache_key(ccm_spec *spec, ccm_target const *t, c8 **cmd)
+{
+    ccm_cache *c = &spec->cache;
+    /* `cmd` comes from ccm_target_command, which memoized the depfile too */
+    if (c->dir == NULL || spec->deplog.fd < 0 || t->depfile == NULL) {
+        return 0;
+    }
+
+    /* output names stay out of the key, the same unit hits for any target */
+    u64 h = ccm_hash_combine(c->compiler, c->cwd);
+    for (s32 i = 0; cmd[i]; ++i) {
+        h = ccm_hash_combine(h, ccm_hash_str8(cmd[i], 0));
+        if (strcmp(cmd[i], spec->output_flag) == 0 || strcmp(cmd[i], "-MF") == 0) {
+            if (cmd[i + 1]) ++i;
+        }
+    }
+    for (s32 i = 0; i < t->sources.len; ++i) {
+        h = ccm_hash_combine(h, ccm_db_file_hash(&spec->db, t->sources.items[i]));
+    }
+    for (s32 i = 0; i < t->watch.len; ++i) {
+        h = ccm_hash_combine(h, ccm_db_file_hash(&spec->db, t->watch.items[i]));
+    }
+    /* a link reads its deps' outputs (libraries, objects) without a depfile entry */
+    for (s32 i = 0; i < t->deps.len; ++i) {
+        h = ccm_hash_combine(h, ccm_db_file_hash(&spec->db, t->deps.items[i]->name));
+    }
+    return h == 0 ? 1 : h;
+}
+
+/* headers discovered by a previous build, missing ones count as changed */
+bool ccm_target_deps_changed(ccm_deplog const *log, ccm_path_table *pt, ccm_target *t)
+{
+    ccm_deplog_entry const *e = ccm_deplog_get(log, t->name);
+    if (e == NULL) return false;
+
+    ccm_path_stat header;
+    s64 output_ns = ccm_target_mtime(pt, t);
+    if (output_ns < 0) return true;
+
+    for (lll i = 0; i < e->len; ++i) {
+        if (!ccm_path_lookup(pt, log->paths.items[e->ids[i]], &header) ||
+            output_ns / 1000000000ll < header.mtime_ns / 1000000000ll) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* the content hash counterpart of ccm_target_needs_rebuild */
+bool ccm_target_needs_rebuild_hash(ccm_spec *spec, ccm_target const *t)
+{
+    ccm_db *db = &spec->db;
+    ccm_db_record *r = ccm_db_get(db, CCM_DB_TARGET, t->name);
+    if (r == NULL) return true;
+
+    u64 inputs = r->target.inputs;
+    u64 output = r->target.output;
+
+    /* NOTE: ccm_db_file_hash may grow the table, `r` is dead from here on */
+    u64 current_output = ccm_db_file_hash(db, t->name);
+    if (current_output == 0 || current_output != output) return true;
+
+    return ccm_target_inputs_hash(spec, t) != inputs;
+}
+
+/* NOTE
+ * Restat, called after `t` was built and before its record is updated: the
+ * output is rehashed and compared with the one the last build recorded.
+ * Compilers rewrite their output even when nothing changed, comment-only
+ * edits to a library don't have to relink everything that uses it.
+ */
+bool ccm_target_restat(ccm_spec *spec, ccm_target const *t)
+{
+    ccm_db_record *r = ccm_db_get(&spec->db, CCM_DB_TARGET, t->name);
+    if (r == NULL || r->target.output == 0) return true;
+
+    u64 before = r->target.output;
+    /* NOTE: ccm_db_file_hash may grow the table, `r` is dead from here on */
+    return ccm_db_file_hash(&spec->db, t->name) != before;
+}
+
+/* the argv is built once, the graph stays resident */
+c8 **ccm_target_command(ccm_spec *spec, ccm_target *t)
+{
+    ccm_manifest const *mf = &spec->manifest;
+    if (t->cmd == NULL && mf->header) {
+        /* the strings stay in the mapping, only the vector is allocated */
+        u32 argc = mf->argc[t->id];
+        c8 *arg  = mf->pool + mf->argv[t->id];
+        t->cmd = ccm_arena_alloc(c8 *, &spec->arena, argc + 1);
+        for (u32 k = 0; k < argc; ++k, arg += strlen(arg) + 1) t->cmd[k] = arg;
+        t->cmd[argc] = NULL;
+        t->depfile = mf->depfile[t->id] ? mf->pool + mf->depfile[t->id] : NULL;
+    }
+    if (t->cmd == NULL) {
+        t->cmd     = spec->command ? spec->command(spec, t) : ccm_compile_cmd(spec, t);
+        t->depfile = ccm_target_depfile(spec, t);
+    }
+    return t->cmd;
+}
+
+u64 ccm_command_hash(c8 **cmd)
+{
+    u64 h = ccm_hash_str8("command", 0);
+    for (s32 i = 0; cmd[i]; ++i) h = ccm_hash_combine(h, ccm_hash_str8(cmd[i], 0));
+    return h == 0 ? 1 : h;
+}
+
+/* a mapped manifest has the hashes of every argv, no-op runs never build one */
+u64 ccm_target_command_hash(ccm_spec *spec, ccm_target *t)
+{
+    if (spec->manifest.header) return spec->manifest.command[t->id];
+    return ccm_command_hash(ccm_target_command(spec, t));
+}
+
+/* NOTE
+ * Compiler, flags and inputs all end up in the argv of a target, comparing
+ * its hash with the one of the last successful build catches flag edits that
+ * no mtime or content check sees. Targets without a recorded command, built
+ * before the database existed, count as unchanged.
+ */
+bool ccm_target_command_changed(ccm_spec *spec, ccm_target *t)
+{
+    if (spec->db.header == NULL) return false;
+
+    u64 command = ccm_target_command_hash(spec, t);
+    ccm_db_record *r = ccm_db_get(&spec->db, CCM_DB_TARGET, t->name);
+    if (r == NULL || r->target.command == 0 || r->target.command == command) return false;
+
+    ccm_log(CCM_LOG_INFO, "Target [%s] command changed\n", t->name);
+    return true;
+}
+
+/* content hashes of inputs and outputs are only kept when something reads them */
+bool ccm_spec_content_checks(ccm_spec const *spec)
+{
+    return spec->db.header && (spec->check == CCM_CHECK_HASH || spec->restat);
+}
+
+/* NOTE
+ * Queues every path the sweep is going to look at for the active targets and
+ * stats them all at once, see ccm_path_table. Deps are active targets of
+ * their own, their outputs are queued with them.
+ */
+void ccm_spec_stat_prepass(ccm_spec *spec)
+{
+    ccm_path_table *pt = &spec->paths;
+    ccm_graph const *g = &spec->graph;
+    ccm_path_reset(pt);
+    for (u32 i = 0; i < g->n; ++i) {
+        if (!(g->state[i] & CCM_NODE_ACTIVE)) continue;
+        ccm_target const *t = spec->deps.items[i];
+        ccm_path_queue(pt, t->name);
+        for (s32 j = 0; j < t->sources.len; ++j) ccm_path_queue(pt, t->sources.items[j]);
+        for (s32 j = 0; j < t->watch.len; ++j)   ccm_path_queue(pt, t->watch.items[j]);
+        for (s32 j = 0; j < t->deps.len; ++j)    ccm_path_queue(pt, t->deps.items[j]->name);
+
+        ccm_deplog_entry const *e = ccm_deplog_get(&spec->deplog, t->name);
+        for (lll j = 0; e && j < e->len; ++j) {
+            ccm_path_queue(pt, spec->deplog.paths.items[e->ids[j]]);
+        }
+    }
+    ccm_path_fill(pt, CCM_STAT_THREADS);
+}
+
+bool ccm_spec_needs_rebuild(ccm_spec *spec, ccm_target *t)
+{
+    if (ccm_target_command_changed(spec, t)) return true;
+    if (spec->check == CCM_CHECK_HASH && spec->db.header) {
+        return ccm_target_needs_rebuild_hash(spec, t);
+    }
+    return ccm_target_needs_rebuild(&spec->paths, t) ||
+        ccm_target_deps_changed(&spec->deplog, &spec->paths, t);
+}
+
+/* anything that is not already an object or a library gets compiled */
+bool ccm_source_is_unit(c8 const *source)
+{
+    c8 const *ext = strrchr(source, '.');
+    return !(ext && (strcmp(ext, ".o") == 0 || strcmp(ext, ".a") == 0 ||
+                     strcmp(ext, ".so") == 0));
+}
+
+s32 ccm_target_units(ccm_target const *t)
+{
+    s32 units = 0;
+    for (s32 i = 0; i < t->sources.len; ++i) {
+        units += ccm_source_is_unit(t->sources.items[i]);
+    }
+    return units;
+}
+
+/* depfiles only work with a single translation unit per compiler invocation,
+ * multi-source targets get one through ccm_spec.objects */
+c8 *ccm_target_depfile(ccm_spec *spec, ccm_target const *t)
+{
+    if (!spec->depfiles || ccm_target_units(t) != 1) return NULL;
+    return ccm_fmt(&spec->arena, "%s.d", t->name);
+}
+
+/* called after `t` was built successfully from inputs hashing to `inputs` */
+void ccm_target_record(ccm_spec *spec, ccm_target const *t, u64 inputs, u64 command,
+                       s64 duration_ns)
+{
+    ccm_db *db = &spec->db;
+    u64 output = ccm_spec_content_checks(spec) ? ccm_db_file_hash(db, t->name) : 0;
+    ccm_db_record *r = ccm_db_put(db, CCM_DB_TARGET, t->name);
+    r->target.inputs      = inputs;
+    r->target.output      = output;
+    r->target.duration_ns = duration_ns;
+    r->target.command     = command;
+    /* cache hits ran no compiler, keep what the last real job used */
+    if (t->maxrss_kb > 0) r->target.maxrss_kb = t->maxrss_kb;
+}
+
+/* NOTE
+ * Weights are the durations recorded by previous runs. Targets without
+ * history get the mean of the known ones, or a unit weight when nothing is
+ * known yet, in which case the priority degrades to the number of targets
+ * left on the longest chain and ties fall back to fan-out and level.
+ * Memory estimates for admission come from the same records, see ccm_pool.
+ *
+ * spec->deps is topologically sorted, walking it backwards visits every
+ * dependent before its dependencies.
+ */
+bool ccm_spec_prioritize(ccm_spec *spec)
+{
+    ccm_graph const *g = &spec->graph;
+    s64 known = 0;
+    s64 total = 0;
+    for (s32 i = 0; i < spec->deps.len; ++i) {
+        ccm_target *t = spec->deps.items[i];
+        ccm_db_record *r = spec->db.header ? ccm_db_get(&spec->db, CCM_DB_TARGET, t->name) : NULL;
+        t->weight = r ? r->target.duration_ns : 0;
+        t->mem_est_kb = t->mem_kb > 0 ? t->mem_kb : r ? r->target.maxrss_kb : 0;
+        known += t->weight > 0;
+        total += t->weight;
+    }
+
+    s64 fallback = known ? total / known : 1;
+    for (s32 i = spec->deps.len - 1; i >= 0; --i) {
+        ccm_target *t = spec->deps.items[i];
+        if (t->weight <= 0) t->weight = fallback;
+
+        t->critical = NULL;
+        for (u32 e = g->rev_off[i]; e < g->rev_off[i + 1]; ++e) {
+            ccm_target *rt = spec->deps.items[g->rev_idx[e]];
+            if (t->critical == NULL || rt->priority > t->critical->priority) {
+                t->critical = rt;
+            }
+        }
+        t->priority = t->weight + (t->critical ? t->critical->priority : 0);
+    }
+    return known > 0;
+}
+
+void ccm_critical_path_print(c8 const *what, f64 ms, ccm_target **path, s32 len)
+{
+    ccm_log(CCM_LOG_INFO, "critical path %s: %.3f ms: ", what, ms);
+    for (s32 i = 0; i < len; ++i) {
+        ccm_log(CCM_LOG_NONE, "%s%s", path[i]->name, i == len - 1 ? "\n" : " ~~~> ");
+    }
+}
+
+/* compares the path the scheduler bet on with the one that gated the build,
+ * `history` tells whether the weights were recorded durations */
+void ccm_spec_report_critical_path(ccm_spec *spec, bool history)
+{
+    ccm_target *predicted = NULL;
+    ccm_target *last      = NULL;
+    s64 first_start = 0;
+
+    for (s32 i = 0; i < spec->deps.len; ++i) {
+        ccm_target *t = spec->deps.items[i];
+        if (t->start_ns == 0) continue;  /* up to date, never ran */
+        if (predicted == NULL || ccm_target_before(&spec->graph, t, predicted)) predicted = t;
+        if (last == NULL || t->end_ns > last->end_ns) last = t;
+        if (first_start == 0 || t->start_ns < first_start) first_start = t->start_ns;
+    }
+    if (predicted == NULL) return;
+
+    ccm_as_scratch_arena(spec->arena) {
+        ccm_target **path = ccm_arena_alloc(ccm_target *, &spec->arena, spec->deps.len);
+        s32 len = 0;
+
+        for (ccm_target *t = predicted; t && t->start_ns != 0; t = t->critical) {
+            path[len++] = t;
+        }
+        if (history) {
+            ccm_critical_path_print("predicted", predicted->priority / 1e6, path, len);
+        } else {
+            ccm_log(CCM_LOG_INFO, "critical path predicted: no recorded durations, "
+                    "%ld targets deep\n", predicted->priority);
+        }
+
+        /* walk back through whichever dependency finished last */
+        len = 0;
+        for (ccm_target *t = last; t && t->start_ns != 0; t = t->last_dep) {
+            path[len++] = t;
+        }
+        for (s32 i = 0; i < len / 2; ++i) ccm_swap(ccm_target *, path[i], path[len - 1 - i]);
+        ccm_critical_path_print("actual", (last->end_ns - path[0]->start_ns) / 1e6, path, len);
+    }
+    ccm_log(CCM_LOG_INFO, "makespan: %.3f ms\n", (last->end_ns - first_start) / 1e6);
+}
+
+s32 ccm_target_costlier(void const *a, void const *b)
+{
+    ccm_target const *x = *(ccm_target *const *)a;
+    ccm_target const *y = *(ccm_target *const *)b;
+    s64 cx = x->end_ns - x->start_ns;
+    s64 cy = y->end_ns - y->start_ns;
+    return (cx < cy) - (cx > cy);
+}
+
+/* the jobs of the last run by wall time, the ones worth splitting or caching */
+void ccm_spec_report_costs(ccm_spec *spec)
+{
+    ccm_as_scratch_arena(spec->arena) {
+        ccm_target **ran = ccm_arena_alloc(ccm_target *, &spec->arena, spec->deps.len);
+        s32 len = 0;
+        s64 wall = 0, user = 0, sys = 0;
+        for (s32 i = 0; i < spec->deps.len; ++i) {
+            ccm_target *t = spec->deps.items[i];
+            if (t->start_ns == 0) continue;
+            ran[len++] = t;
+            wall += t->end_ns - t->start_ns;
+            user += t->utime_ns;
+            sys  += t->stime_ns;
+        }
+        if (len == 0) continue; /* still restores the arena */
+        qsort(ran, len, sizeof(*ran), ccm_target_costlier);
+
+        ccm_log(CCM_LOG_INFO, "%10s %10s %10s %12s  %s\n",
+                "wall ms", "user ms", "sys ms", "maxrss KiB", "target");
+        for (s32 i = 0; i < len && i < CCM_COST_TABLE_ROWS; ++i) {
+            ccm_target *t = ran[i];
+            ccm_log(CCM_LOG_INFO, "%10.3f %10.3f %10.3f %12ld  %s\n",
+                    (t->end_ns - t->start_ns) / 1e6, t->utime_ns / 1e6,
+                    t->stime_ns / 1e6, t->maxrss_kb, t->name);
+        }
+        if (len > CCM_COST_TABLE_ROWS) {
+            ccm_log(CCM_LOG_INFO, "... %d more\n", len - CCM_COST_TABLE_ROWS);
+        }
+        ccm_log(CCM_LOG_INFO, "%10.3f %10.3f %10.3f %12s  total of %d jobs\n",
+                wall / 1e6, user / 1e6, sys / 1e6, "", len);
+    }
+}
+
+/* builds the CSR adjacency of `ts`, every target's id must be its index */
+void ccm_graph_link(ccm_graph *g, ccm_arena *arena, ccm_target_array ts)
+{
+    u32 n = ts.len;
+    g->n = n;
+    g->dep_off = ccm_arena_alloc(u32, arena, n + 1);
+    g->rev_off = ccm_arena_alloc(u32, arena, n + 1);
+    memset(g->rev_off, 0, (n + 1) * sizeof(u32));
+
+    g->dep_off[0] = 0;
+    for (u32 i = 0; i < n; ++i) {
+        ccm_target *t = ts.items[i];
+        for (s32 j = 0; j < t->deps.len; ++j) {
+            ccm_target *dep = t->deps.items[j];
+            if (dep->id >= n || ts.items[dep->id] != dep) {
+                ccm_panic("target %s depends on %s, which is not in spec->deps\n",
+                          t->name, dep->name);
+            }
+            g->rev_off[dep->id + 1] += 1;
+        }
+        g->dep_off[i + 1] = g->dep_off[i] + t->deps.len;
+    }
+    for (u32 i = 0; i < n; ++i) g->rev_off[i + 1] += g->rev_off[i];
+
+    u32 m = g->dep_off[n];
+    g->dep_idx = ccm_arena_alloc(u32, arena, m);
+    g->rev_idx = ccm_arena_alloc(u32, arena, m);
+    /* fills each revdep row from its start, rev_off is shifted back after */
+    for (u32 i = 0; i < n; ++i) {
+        ccm_target *t = ts.items[i];
+        for (s32 j = 0; j < t->deps.len; ++j) {
+            u32 d = t->deps.items[j]->id;
+            g->dep_idx[g->dep_off[i] + j] = d;
+            g->rev_idx[g->rev_off[d]++] = i;
+        }
+    }
+    for (u32 i = n; i > 0; --i) g->rev_off[i] = g->rev_off[i - 1];
+    g->rev_off[0] = 0;
+}
+
+/* NOTE
+ * Kahn's algorithm: targets whose deps are all sorted wait in a FIFO, so the
+ * order comes out level by level and nothing recurses on long chains. Writes
+ * the topological order and levels, returns how many targets got sorted, less
+ * than g->n when the rest sits on or behind a cycle.
+ */
+u32 ccm_graph_sort(ccm_graph const *g, ccm_arena *scratch, u32 *order, s32 *level)
+{
+    u32 sorted = 0;
+    ccm_as_scratch_arena(*scratch) {
+        u32 *indeg = ccm_arena_alloc(u32, scratch, g->n);
+        u32 tail = 0;
+        for (u32 i = 0; i < g->n; ++i) {
+            indeg[i] = ccm_graph_deps(g, i);
+            level[i] = 1;
+            if (indeg[i] == 0) order[tail++] = i;
+        }
+        for (; sorted < tail; ++sorted) {
+            u32 i = order[sorted];
+            for (u32 e = g->rev_off[i]; e < g->rev_off[i + 1]; ++e) {
+                u32 r = g->rev_idx[e];
+                level[r] = ccm_s32_max(level[r], level[i] + 1);
+                if (--indeg[r] == 0) order[tail++] = r;
+            }
+        }
+        if (sorted == g->n) continue; /* still restores the arena */
+
+        /* every target left has an unsorted dep, following those for n steps
+         * ends up on the cycle */
+        u32 i = 0;
+        while (indeg[i] == 0) ++i;
+        for (u32 k = 0; k < g->n; ++k) {
+            u32 e = g->dep_off[i];
+            while (indeg[g->dep_idx[e]] == 0) ++e;
+            i = g->dep_idx[e];
+        }
+        order[sorted] = i;
+    }
+    return sorted;
+}
 
-bool ccm_target_needs_rebuild(ccm_target const *t)
+bool ccm_target_splittable(ccm_target const *t)
 {
-    struct stat outfile_stat;
-    struct stat srcfile_stat;
+    if (t->kind != CCM_TARGET_DEFAULT || ccm_target_units(t) < 2) return false;
+    /* a -c target with several sources has nothing to link */
+    for (s32 i = 0; i < t->pre_opts.len; ++i) {
+        if (strcmp(t->pre_opts.items[i], "-c") == 0) return false;
+    }
+    return true;
+}
 
-    time_t output_mtime = 0;
+/* "./src/a.c" -> "src_a.c", keeps object paths flat below their target dir */
+c8 *ccm_path_flatten(ccm_arena *arena, c8 const *path)
+{
+    while (path[0] == '.' && path[1] == '/') path += 2;
+    c8 *flat = ccm_fmt(arena, "%s", path);
+    for (c8 *p = flat; *p; ++p) {
+        if (*p == '/') *p = '_';
+    }
+    return flat;
+}
 
-    if (stat(t->name, &outfile_stat) < 0) {
-        return true;
+/* NOTE
+ * Splits every multi-source default target into one CCM_TARGET_OBJECT per
+ * translation unit and turns the target itself into a CCM_TARGET_LINK over
+ * those objects. Objects inherit the target's deps (generated headers), so
+ * the usual scheduling and propagation order the graph:
+ *
+ *     app [a.c b.c lib.o]   ==>   app.o/a.c.o ---+
+ *                                 app.o/b.c.o ---+--> app [a.c.o b.c.o lib.o]
+ *
+ * The new targets are appended to spec->deps, before scheduling.
+ */
+void ccm_spec_expand_objects(ccm_spec *spec)
+{
+    ccm_arena *arena = &spec->arena;
+    c8 const *objdir = spec->objdir ? spec->objdir : CCM_OBJDIR_DEFAULT_PATH;
+
+    lll nobjects = 0;
+    for (s32 i = 0; i < spec->deps.len; ++i) {
+        ccm_target *t = spec->deps.items[i];
+        if (ccm_target_splittable(t)) nobjects += ccm_target_units(t);
     }
-    output_mtime = outfile_stat.st_mtime;
+    if (nobjects == 0) return;
 
-    for (s32 i = 0; i < t->sources.len; ++i) {
-        if (stat(t->sources.items[i], &srcfile_stat) != -1 &&
-            output_mtime < srcfile_stat.st_mtime) {
-            return true;
+    ccm_target_array all = {
+        .items = ccm_arena_alloc(ccm_target *, arena, spec->deps.len + nobjects),
+        .len   = spec->deps.len,
+    };
+    memcpy(all.items, spec->deps.items, spec->deps.len * sizeof(ccm_target *));
+
+    for (s32 i = 0; i < spec->deps.len; ++i) {
+        ccm_target *t = spec->deps.items[i];
+        if (!ccm_target_splittable(t)) continue;
+
+        s32 units = ccm_target_units(t);
+        c8 *dir = ccm_fmt(arena, "%s/%s", objdir, ccm_path_flatten(arena, t->name));
+
+        ccm_str8_array pre_opts = {
+            .items = ccm_arena_alloc(c8 *, arena, t->pre_opts.len + 1),
+            .len   = 0,
+        };
+        for (s32 j = 0; j < t->pre_opts.len; ++j) {
+            pre_opts.items[pre_opts.len++] = t->pre_opts.items[j];
+        }
+        pre_opts.items[pre_opts.len++] = "-c";
+
+        ccm_target_array link_deps = {
+            .items = ccm_arena_alloc(ccm_target *, arena, t->deps.len + units),
+            .len   = 0,
+        };
+        for (s32 j = 0; j < t->deps.len; ++j) {
+            link_deps.items[link_deps.len++] = t->deps.items[j];
+        }
+
+        ccm_str8_array link_sources = {
+            .items = ccm_arena_alloc(c8 *, arena, t->sources.len),
+            .len   = t->sources.len,
+        };
+
+        for (s32 j = 0; j < t->sources.len; ++j) {
+            c8 *source = t->sources.items[j];
+            if (!ccm_source_is_unit(source)) {
+                link_sources.items[j] = source;
+                continue;
+            }
+
+            ccm_target *obj = ccm_arena_alloc(ccm_target, arena);
+            *obj = (ccm_target) {
+                .name     = ccm_fmt(arena, "%s/%s.o", dir, ccm_path_flatten(arena, source)),
+                .sources  = { .len = 1, .items = &t->sources.items[j] },
+                .watch    = t->watch,
+                .pre_opts = pre_opts,
+                .deps     = t->deps,
+                .kind     = CCM_TARGET_OBJECT,
+            };
+            ccm_mkdir_parents(obj->name);
+
+            link_sources.items[j] = obj->name;
+            link_deps.items[link_deps.len++] = obj;
+            all.items[all.len++] = obj;
         }
+
+        t->sources = link_sources;
+        t->deps    = link_deps;
+        t->kind    = CCM_TARGET_LINK;
+        /* the objects are the only inputs left, headers are theirs to watch */
+        t->watch   = (ccm_str8_array){0};
     }
 
-    for (s32 i = 0; i < t->watch.len; ++i) {
-        if (stat(t->watch.items[i], &srcfile_stat) != -1 &&
-            output_mtime < srcfile_stat.st_mtime) {
-            return true;
+    spec->deps = all;
+}
+
+/* NOTE
+ * The key of the manifest: the spec binary, by inode and mtime, and whatever
+ * the graph and the argv of the targets it declared are built from. Deps are
+ * hashed by name, 0 when the binary can't be told apart or a command hook
+ * builds argv from who knows what.
+ */
+u64 ccm_spec_fingerprint(ccm_spec const *spec)
+{
+    if (spec->command) return 0;
+
+    struct stat st;
+    if (stat("/proc/self/exe", &st) < 0) return 0;
+    s64 exe[] = {
+        st.st_dev, st.st_ino, st.st_size,
+        ccm_timespec_ns(st.st_mtim), CCM_MANIFEST_VERSION,
+    };
+    u64 h = ccm_hash64(exe, sizeof(exe), 0);
+
+    h = ccm_hash_combine(h, ccm_hash_str8(spec->compiler ? spec->compiler : "", 0));
+    h = ccm_hash_combine(h, ccm_hash_str8(spec->output_flag ? spec->output_flag : "", 0));
+    h = ccm_hash_combine(h, ccm_hash_str8(spec->objdir ? spec->objdir : "", 0));
+    h = ccm_hash_combine(h, spec->objects | spec->depfiles << 1);
+    h = ccm_hash_str8_array(h, spec->common_opts);
+    h = ccm_hash_str8_array(h, spec->select);
+    for (s32 i = 0; i < spec->deps.len; ++i) {
+        ccm_target const *t = spec->deps.items[i];
+        h = ccm_hash_combine(h, ccm_hash_str8(t->name, t->kind));
+        h = ccm_hash_str8_array(h, t->sources);
+        h = ccm_hash_str8_array(h, t->watch);
+        h = ccm_hash_str8_array(h, t->pre_opts);
+        h = ccm_hash_str8_array(h, t->post_opts);
+        h = ccm_hash_combine(h, t->deps.len);
+        for (s32 j = 0; j < t->deps.len; ++j) {
+            h = ccm_hash_combine(h, ccm_hash_str8(t->deps.items[j]->name, 0));
         }
     }
+    return h == 0 ? 1 : h;
+}
 
-    return false;
+/* fnmatch(3) on the target name, a leading "./" on either side never matters */
+bool ccm_target_matches(ccm_target const *t, c8 const *pattern)
+{
+    c8 const *name = t->name;
+    while (name[0] == '.' && name[1] == '/') name += 2;
+    while (pattern[0] == '.' && pattern[1] == '/') pattern += 2;
+    return fnmatch(pattern, name, 0) == 0;
 }
 
-s32 ccm_spec_schedule_target(ccm_spec *spec, ccm_target *t, ccm_target_array *ta)
+#define CCM_SELECTED (CCM_GRAPH_NONE - 1)
+
+/* NOTE
+ * Narrows spec->deps down to the selected targets and everything they depend
+ * on, in listing order. The rest of the spec is never stat'ed, hashed or
+ * scheduled. Every pattern has to match something, a typo fails the build
+ * rather than silently building nothing.
+ */
+void ccm_spec_select(ccm_spec *spec)
 {
-    if (t->collected) return t->level;
-    if (t->visited) {
-        ccm_panic("cycle detected: %s\n", t->name);
+    ccm_arena *arena = &spec->arena;
+    lll cap = spec->deps.len;
+    for (s32 i = 0; i < spec->deps.len; ++i) {
+        spec->deps.items[i]->id = CCM_GRAPH_NONE;
+        cap += spec->deps.items[i]->deps.len;
     }
-    t->visited = 1;
 
-    s32 level = 0;
-    for (s32 i = 0; i < t->deps.len; ++i) {
-        level = ccm_s32_max(level, ccm_spec_schedule_target(spec, t->deps.items[i], ta));
+    ccm_target **stack = ccm_arena_alloc(ccm_target *, arena, cap);
+    lll len = 0;
+    for (s32 i = 0; i < spec->select.len; ++i) {
+        bool matched = false;
+        for (s32 j = 0; j < spec->deps.len; ++j) {
+            ccm_target *t = spec->deps.items[j];
+            if (!ccm_target_matches(t, spec->select.items[i])) continue;
+            matched = true;
+            if (t->id == CCM_SELECTED) continue;
+            t->id = CCM_SELECTED;
+            stack[len++] = t;
+        }
+        if (!matched) ccm_panic("no target matches %s\n", spec->select.items[i]);
+    }
+    while (len > 0) {
+        ccm_target *t = stack[--len];
+        for (s32 j = 0; j < t->deps.len; ++j) {
+            ccm_target *dep = t->deps.items[j];
+            if (dep->id == CCM_SELECTED) continue;
+            dep->id = CCM_SELECTED;
+            stack[len++] = dep;
+        }
     }
-    level += 1;
-    t->level = level;
-    t->collected = 1;
-    ta->items[ta->len++] = t;
 
-    return t->level;
+    ccm_target_array selected = {
+        .items = ccm_arena_alloc(ccm_target *, arena, spec->deps.len),
+        .len   = 0,
+    };
+    for (s32 i = 0; i < spec->deps.len; ++i) {
+        ccm_target *t = spec->deps.items[i];
+        if (t->id == CCM_SELECTED) selected.items[selected.len++] = t;
+    }
+    ccm_log(CCM_LOG_INFO, "select: %ld of %ld targets\n", selected.len, spec->deps.len);
+    spec->deps = selected;
 }
 
+/* NOTE
+ * Numbers the targets in listing order, dropping duplicates, sorts them and
+ * renumbers them in topological order. spec->deps and spec->graph then share
+ * the ids, the graph built for the sort is scratch. A mapped manifest already
+ * has the order and the graph of the same listing.
+ */
 void ccm_spec_schedule(ccm_spec *spec)
 {
-    ccm_target_array ta = {
-        .items = ccm_arena_alloc(ccm_target*, &spec->arena, spec->deps.len),
+    if (spec->objects) ccm_spec_expand_objects(spec);
+    if (spec->select.len > 0) ccm_spec_select(spec);
+
+    ccm_arena *arena = &spec->arena;
+    ccm_target_array listed = {
+        .items = ccm_arena_alloc(ccm_target *, arena, spec->deps.len),
         .len   = 0,
     };
-
+    for (s32 i = 0; i < spec->deps.len; ++i) spec->deps.items[i]->id = CCM_GRAPH_NONE;
     for (s32 i = 0; i < spec->deps.len; ++i) {
-        ccm_spec_schedule_target(spec, spec->deps.items[i], &ta);
+        ccm_target *t = spec->deps.items[i];
+        if (t->id != CCM_GRAPH_NONE) continue;
+        t->id = listed.len;
+        listed.items[listed.len++] = t;
+    }
+
+    u32 n = listed.len;
+    ccm_graph *g = &spec->graph;
+    ccm_manifest *mf = &spec->manifest;
+    if (mf->header && mf->header->n != n) {
+        ccm_log(CCM_LOG_WARN, "manifest: %u targets, the spec has %u, rescheduling\n",
+                mf->header->n, n);
+        ccm_manifest_close(mf);
+    }
+
+    if (mf->header) {
+        *g = (ccm_graph){
+            .n       = n,
+            .order   = mf->order,
+            .dep_off = mf->dep_off,
+            .dep_idx = mf->dep_idx,
+            .rev_off = mf->rev_off,
+            .rev_idx = mf->rev_idx,
+            .level   = mf->level,
+        };
+    } else {
+        g->order = ccm_arena_alloc(u32, arena, n);
+        g->level = ccm_arena_alloc(s32, arena, n);
+        ccm_as_scratch_arena(*arena) {
+            ccm_graph lg = {0};
+            ccm_graph_link(&lg, arena, listed);
+            s32 *lv = ccm_arena_alloc(s32, arena, n);
+            u32 sorted = ccm_graph_sort(&lg, arena, g->order, lv);
+            if (sorted < n) ccm_panic("cycle detected: %s\n", listed.items[g->order[sorted]]->name);
+            for (u32 i = 0; i < n; ++i) g->level[i] = lv[g->order[i]];
+        }
     }
 
+    ccm_target_array ta = {
+        .items = ccm_arena_alloc(ccm_target *, arena, n),
+        .len   = n,
+    };
+    for (u32 i = 0; i < n; ++i) {
+        ta.items[i] = listed.items[g->order[i]];
+        ta.items[i]->id = i;
+    }
     spec->deps = ta;
 
+    if (mf->header == NULL) ccm_graph_link(g, arena, ta);
+    g->pending = ccm_arena_alloc(s32, arena, n);
+    g->state   = ccm_arena_alloc(u8, arena, n);
+    g->stack   = ccm_arena_alloc(u32, arena, n);
+    memset(g->pending, 0, n * sizeof(s32));
+    memset(g->state, 0, n);
+
     ccm_log(CCM_LOG_INFO, "job schedule: ");
-    for (s32 i = 0; i < ta.len - 1; ++i) {
-        ccm_log(CCM_LOG_NONE, "{%s: %d} ~~~> ",
-                ta.items[i]->name, ta.items[i]->level);
+    if (n == 0) ccm_log(CCM_LOG_NONE, "no targets\n");
+    for (u32 i = 0; i < n; ++i) {
+        ccm_log(CCM_LOG_NONE, "{%s: %d}%s",
+                ta.items[i]->name, g->level[i], i + 1 < n ? " ~~~> " : "\n");
     }
-    ccm_log(CCM_LOG_NONE, "{%s: %d}\n",
-            ta.items[ta.len - 1]->name,
-            ta.items[ta.len - 1]->level);
 
     ccm_sep(80);
 }
 
-void ccm_cmd_print(ccm_arena scratch, c8 **cmd)
+void ccm_cmd_print(ccm_arena *scratch, c8 **cmd)
 {
     s32 len = 0;
     c8 **cmd_copy = cmd;
     for (; *cmd_copy; ++cmd_copy) len += strlen(*cmd_copy) + 1;
 
-    c8 *buf = ccm_arena_alloc(c8, &scratch, len + 1);
+    ccm_arena_mark mark = ccm_arena_save(scratch);
+    c8 *buf = ccm_arena_alloc(c8, scratch, len + 1);
 
     s32 remaining = len + 1;
     c8 *itr_buf = buf;
@@ -849,19 +4440,23 @@ void ccm_cmd_print(ccm_arena scratch, c8 **cmd)
         s32 n = snprintf(itr_buf, remaining, "%s ", *cmd_copy);
         if (n < 0 || n >= remaining) {
             ccm_log(CCM_LOG_ERROR, "CMD: possible buffer overflow\n");
-            return;
+            break;
         }
         itr_buf += n;
         remaining -= n;
     }
-    ccm_log(CCM_LOG_INFO, "CMD: %s\n", buf);
+    if (*cmd_copy == NULL) ccm_log(CCM_LOG_INFO, "CMD: %s\n", buf);
+    ccm_arena_rewind(scratch, mark);
 }
 
 c8 **ccm_compile_cmd(ccm_spec *spec, ccm_target const *t)
 {
+    c8 *depfile = ccm_target_depfile(spec, t);
+
     lll cmd_len = 1             /* compiler */
         + spec->common_opts.len
         + t->pre_opts.len
+        + (depfile ? 3 : 0)     /* -MMD -MF depfile */
         + 1                     /* -o */
         + 1                     /* name */
         + t->sources.len
@@ -880,6 +4475,12 @@ c8 **ccm_compile_cmd(ccm_spec *spec, ccm_target const *t)
         cmd[cmd_len++] = t->pre_opts.items[i];
     }
 
+    if (depfile) {
+        cmd[cmd_len++] = "-MMD";
+        cmd[cmd_len++] = "-MF";
+        cmd[cmd_len++] = depfile;
+    }
+
     cmd[cmd_len++] = spec->output_flag;
     cmd[cmd_len++] = t->name;
 
@@ -895,81 +4496,197 @@ c8 **ccm_compile_cmd(ccm_spec *spec, ccm_target const *t)
     return cmd;
 }
 
-void ccm_proc_mgr_pub_ev(ccm_proc_mgr *pm)
+/* stamps the exit time and the child's rusage on its target */
+void ccm_childproc_account(ccm_childproc *cp)
 {
-    ccm_childproc *cps = pm->cps;
-    pollfd *pfds       = pm->pfds;
-    ccm_event *evs     = pm->evs;
-    s32 nrunning       = pm->nrunning;
+    ccm_target *t = cp->target;
+    cp->running  = false;
+    t->end_ns    = ccm_now_ns();
+    t->utime_ns  = ccm_timespec_ns((struct timespec){ cp->usage.ru_utime.tv_sec,
+                                                      cp->usage.ru_utime.tv_usec * 1000 });
+    t->stime_ns  = ccm_timespec_ns((struct timespec){ cp->usage.ru_stime.tv_sec,
+                                                      cp->usage.ru_stime.tv_usec * 1000 });
+    t->maxrss_kb = cp->usage.ru_maxrss;
+}
 
-    s32 nready = poll(pfds, nrunning, pm->timeout);
-    if (nready == -1) {
-        ccm_panic("poll: polling bootstrap child proc failed with error %s\n",
-                  strerror(errno));
-    }
+void ccm_proc_mgr_reap(ccm_proc_mgr *pm, s32 slot)
+{
+    ccm_childproc *cp = &pm->cps[slot];
+    s32 ret = wait4(cp->pid, &cp->status, WNOHANG, &cp->usage);
 
-    ccm_assert(nready <= nrunning);
+    if (ret == -1) {
+        if (errno == ECHILD) {
+            ccm_panic("Target [%s]: invalid child process\n", cp->target->name);
+        }
+        ccm_proc_mgr_post(pm, slot, CCM_EVENT_WAIT_ERROR);
+        return;
+    }
+    if (ret == 0) return; /* spurious, the child is still running */
 
-    for (s32 i = 0; nready && i < nrunning; ++i) {
-        if (pfds[i].revents == 0) continue;
+    ccm_childproc_account(cp);
+    if (WIFEXITED(cp->status)) {
+        ccm_proc_mgr_post(pm, slot, CCM_EVENT_WAIT_DONE);
+    } else if (WIFSIGNALED(cp->status)) {
+        ccm_proc_mgr_post(pm, slot, CCM_EVENT_WAIT_TERM);
+    }
+}
 
-        if (pfds[i].revents & POLLIN) {
-            evs[i] |= CCM_EVENT_POLLIN;
-        }
-        if (pfds[i].revents & POLLHUP) {
-            evs[i] |= CCM_EVENT_POLLHUP;
-            pfds[i].events = 0;
-            pfds[i].revents = 0;
-            pfds[i].fd = -1;
-        }
-        if (pfds[i].revents & POLLERR) {
-            evs[i] |= CCM_EVENT_POLLERR;
+/* SIGCHLD does not say which child, collect every one that exited */
+void ccm_proc_mgr_reap_all(ccm_proc_mgr *pm)
+{
+    struct signalfd_siginfo info[16];
+    while (read(pm->sigfd, info, sizeof(info)) > 0);
+
+    for (;;) {
+        s32 status;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, WNOHANG, &usage);
+        if (pid <= 0) break;
+
+        for (s32 i = 0; i < pm->maxjobs; ++i) {
+            ccm_childproc *cp = &pm->cps[i];
+            if (cp->target == NULL || cp->pid != pid) continue;
+            cp->status = status;
+            cp->usage  = usage;
+            ccm_childproc_account(cp);
+            ccm_proc_mgr_post(pm, i, WIFSIGNALED(status)
+                              ? CCM_EVENT_WAIT_TERM : CCM_EVENT_WAIT_DONE);
+            break;
         }
-
-        --nready;
     }
+}
+
+void ccm_proc_mgr_pub_ev(ccm_proc_mgr *pm)
+{
+    struct epoll_event events[CCM_EPOLL_MAX_EVENTS];
 
-    for (s32 i = 0; i < nrunning; ++i) {
-        s32 ret = waitpid(cps[i].pid, &cps[i].status, WNOHANG);
+    s32 nready = epoll_wait(pm->epfd, events, CCM_EPOLL_MAX_EVENTS, pm->timeout);
+    if (nready == -1) {
+        if (errno == EINTR) return;
+        ccm_panic("epoll_wait: waiting on child procs failed with error %s\n",
+                  strerror(errno));
+    }
 
-        if (ret == -1) {
-            if (errno == EINTR) evs[i] |= CCM_EVENT_WAIT_PENDING;
-            if (errno == ECHILD) {
-                ccm_panic("Target [%s]: invalid child process\n", cps[i].target->name);
+    for (s32 i = 0; i < nready; ++i) {
+        u64 data = events[i].data.u64;
+        if (data == CCM_EPOLL_SIGCHLD) {
+            ccm_proc_mgr_reap_all(pm);
+            continue;
+        }
+        if (data == CCM_EPOLL_JOBSERVER) {
+            /* the run loop takes the token, or arms again if someone else did */
+            ccm_proc_mgr_arm_jobserver(pm, false);
+            continue;
+        }
+        if (data == CCM_EPOLL_INTERRUPT) {
+            struct signalfd_siginfo info;
+            if (read(pm->intfd, &info, sizeof(info)) == sizeof(info)) {
+                pm->signal = info.ssi_signo;
+                ccm_proc_mgr_stop(pm, info.ssi_signo);
             }
-            evs[i] |= CCM_EVENT_WAIT_ERROR;
             continue;
         }
 
-        if (ret == 0) {
-            evs[i] |= CCM_EVENT_WAIT_PENDING;
+        s32 slot = data >> 1;
+        if (data & 1) {
+            ccm_proc_mgr_reap(pm, slot);
             continue;
         }
 
-        if (WIFEXITED(cps[i].status)) {
-            evs[i] |= CCM_EVENT_WAIT_DONE;
-        } else if (WIFSIGNALED(cps[i].status)) {
-            evs[i] |= CCM_EVENT_WAIT_TERM;
-        }
+        if (events[i].events & EPOLLIN)  ccm_proc_mgr_post(pm, slot, CCM_EVENT_POLLIN);
+        if (events[i].events & EPOLLHUP) ccm_proc_mgr_post(pm, slot, CCM_EVENT_POLLHUP);
+        if (events[i].events & EPOLLERR) ccm_proc_mgr_post(pm, slot, CCM_EVENT_POLLERR);
+    }
+}
+
+/* NOTE
+ * epoll keys registrations by open file, not by fd number. A child that has
+ * not reached exec yet still holds copies of our fds, so a plain close()
+ * would leave a stale registration that fires under a recycled slot.
+ */
+void ccm_proc_mgr_close(ccm_proc_mgr *pm, s32 *fd)
+{
+    if (*fd < 0) return;
+    epoll_ctl(pm->epfd, EPOLL_CTL_DEL, *fd, NULL);
+    if (close(*fd) != 0) {
+        ccm_log(CCM_LOG_ERROR, "close: fd %d failed: %s\n", *fd, strerror(errno));
+    }
+    *fd = -1;
+}
+
+/* schedules the graph once, it stays resident for later runs */
+void ccm_spec_prepare(ccm_spec *spec)
+{
+    if (spec->scheduled) return;
+
+    /* useful for cycle detection and removing duplicates, builds the graph
+     * ccm_target_propagate_done walks */
+    s64 span = ccm_trace_begin(&spec->trace);
+    u64 key = spec->manifest.path ? ccm_spec_fingerprint(spec) : 0;
+    if (key) ccm_manifest_load(&spec->manifest, key);
+    ccm_spec_schedule(spec);
+    ccm_trace_end(&spec->trace, "ccm_spec_schedule", span);
+
+    if (key && spec->manifest.header == NULL) {
+        span = ccm_trace_begin(&spec->trace);
+        ccm_manifest_write(spec, key);
+        ccm_trace_end(&spec->trace, "ccm_manifest_write", span);
     }
+    ccm_arena_phase(&spec->arena, "schedule");
+    spec->scheduled = true;
 }
 
-void ccm_proc_mgr_run(ccm_proc_mgr *pm)
+s32 ccm_proc_mgr_run(ccm_proc_mgr *pm)
+{
+    ccm_spec *spec = pm->spec;
+    ccm_spec_prepare(spec);
+    memset(spec->graph.state, CCM_NODE_ACTIVE, spec->graph.n);
+    return ccm_proc_mgr_run_active(pm);
+}
+
+/* builds the active targets, their revdeps must be active too, returns the
+ * signal that interrupted the run or 0, the caller cleans up and raises it */
+s32 ccm_proc_mgr_run_active(ccm_proc_mgr *pm)
 {
     ccm_spec      *spec = pm->spec;
+    ccm_graph     *g    = &spec->graph;
     ccm_childproc *cps  = pm->cps;
-    pollfd        *pfds = pm->pfds;
     ccm_event     *evs  = pm->evs;
 
     s32 uptodate = 0;
+    s32 active   = 0;
 
-    ccm_ring_buffer ready_queue = ccm_init_rb(&spec->arena, spec->deps.len);
+    /* sized after scheduling, ccm_spec.objects may have added targets */
+    if (pm->ready_queue.items == NULL) {
+        pm->ready_queue = ccm_init_pq(&spec->arena, &spec->graph, spec->deps.len);
+        pm->held = ccm_arena_alloc(ccm_target *, &spec->arena, spec->deps.len);
+    }
+    ccm_prio_queue *ready_queue = &pm->ready_queue;
 
-    /* useful for cycle detection and removing duplicates */
-    ccm_spec_schedule(spec);
+    /* the ready queue hands out targets by their remaining critical path */
+    pm->history = ccm_spec_prioritize(spec);
+
+    for (s32 i = 0; i < spec->deps.len; ++i) {
+        ccm_target *t = spec->deps.items[i];
+        t->start_ns = t->end_ns = 0;
+        t->utime_ns = t->stime_ns = 0;
+        t->maxrss_kb = 0;
+        if (!(g->state[i] & CCM_NODE_ACTIVE)) continue;
+        ++active;
+        t->last_dep = NULL;
+        t->mtime_ns = 0;
+        g->state[i] &= ~(CCM_NODE_STALE | CCM_NODE_DONE | CCM_NODE_FAILED | CCM_NODE_SKIPPED | CCM_NODE_INTERRUPTED);
+        g->pending[i] = 0;
+        for (u32 e = g->dep_off[i]; e < g->dep_off[i + 1]; ++e) {
+            g->pending[i] += g->state[g->dep_idx[e]] & CCM_NODE_ACTIVE;
+        }
+    }
+
+    s64 prepass = ccm_trace_begin(&spec->trace);
+    ccm_spec_stat_prepass(spec);
+    ccm_trace_end(&spec->trace, "stat prepass", prepass);
 
-    /* compute dependent arrays before any call to ccm_target_propagate_done */
-    ccm_compute_dependents(pm->spec);
+    s64 sweep = ccm_trace_begin(&spec->trace);
 
     for (s32 i = 0; i < spec->deps.len; ++i) {
         /* NOTE
@@ -986,13 +4703,18 @@ void ccm_proc_mgr_run(ccm_proc_mgr *pm)
          *     propagation of completed targets are not checked for rebuild,
          * else:
          *     t0 and t1 are skipped, but they cause t2 and t3 to become leaves,
-         *     their deps.len is now zero after propagating they are done. So now
+         *     their pending count is now zero after propagating they are done. So now
          *     we have t3 and t2 to do the same check of whether if they need rebuild
          *     or not.
          *
          * Note that we don't check in the event loop whether a target requires rebuild
          * or not, since a target added to the ready queue in the event loop is a target
-         * that had a dependency rebuilt, so the target is automatically rebuilt.
+         * that had a dependency rebuilt, so the target is automatically rebuilt. With
+         * ccm_spec.restat only a dependency whose output changed counts as rebuilt,
+         * see ccm_target_propagate_done.
+         *
+         * Targets outside the active set count as done, `pending` only counts
+         * active deps, so a watch run sweeps just the affected sub-DAG.
          *
          * This might seem a recursive problem: how do we check leaves and after we
          * propagate their no-need to rebuild, how do we check the new leaves, and after
@@ -1005,95 +4727,238 @@ void ccm_proc_mgr_run(ccm_proc_mgr *pm)
          * This is why we do it after the ccm_spec_schedule
          */
         ccm_target *t = spec->deps.items[i];
-        if (t->deps.len == 0) {
-            if (ccm_target_needs_rebuild(t)) {
-                ccm_rb_push(&ready_queue, t);
+        if ((g->state[i] & CCM_NODE_ACTIVE) && g->pending[i] == 0) {
+            /* mtimes have a 1s granularity here, trust the watcher unless
+             * hashes can tell a no-op save apart */
+            bool forced = (g->state[i] & CCM_NODE_DIRTY) && spec->check != CCM_CHECK_HASH;
+            if (forced || ccm_spec_needs_rebuild(spec, t)) {
+                ccm_pq_push(ready_queue, t);
             } else {
                 ++uptodate;
                 ccm_log(CCM_LOG_INFO,
                         "Target [%s] upto date, skip rebuild\n",
                         t->name);
                 ccm_sep(80);
-                ccm_target_propagate_done(t, &ready_queue);
+                ccm_target_propagate_uptodate(spec, t);
             }
         }
     }
 
 
-    s32 remaining_targets = spec->deps.len - uptodate;
+    ccm_trace_end(&spec->trace, "up-to-date sweep", sweep);
+
+    s32 remaining_targets = active - uptodate;
     s32 read_mask = (CCM_EVENT_WAIT_DONE | CCM_EVENT_POLLIN | CCM_EVENT_POLLHUP);
     s32 done_mask = (CCM_EVENT_WAIT_DONE | CCM_EVENT_WAIT_ERROR | CCM_EVENT_WAIT_TERM);
 
 
-    while (remaining_targets > 0) {
+    pm->nfailed = pm->ninterrupted = pm->nskipped = 0;
+    pm->stopping = false;
+    pm->signal = 0;
+    /* the jobs left the terminal's process group, interrupts go through us */
+    sigset_t saved;
+    sigprocmask(SIG_BLOCK, &pm->intmask, &saved);
+
+    while (remaining_targets > 0 && !(pm->stopping && pm->nrunning == 0)) {
 #ifdef CCM_INTERNAL_DEBUG
-        ccm_rb_print(&ready_queue);
+        ccm_pq_print(ready_queue);
 #endif
 
-        for (ccm_target *t = ccm_rb_peek(&ready_queue);
-             ready_queue.len > 0 && ccm_proc_mgr_add_target(pm, t);
-             ccm_rb_pop(&ready_queue), t = ccm_rb_peek(&ready_queue));
+        if (pm->adaptive) ccm_proc_mgr_adapt(pm);
+        s32 nheld = 0;
+        while (ready_queue->len > 0 && !pm->stopping) {
+            ccm_target *t = ccm_pq_peek(ready_queue);
+            if (ccm_pool_full(t->pool)) {
+                pm->held[nheld++] = ccm_pq_pop(ready_queue);
+                continue;
+            }
+            if (!ccm_proc_mgr_add_target(pm, t)) break;
+            ccm_pq_pop(ready_queue);
+        }
+        while (nheld > 0) ccm_pq_push(ready_queue, pm->held[--nheld]);
 
 #ifdef CCM_INTERNAL_DEBUG
         ccm_log(CCM_LOG_DEBUG, "proc_mgr: nrunning = %d\n", pm->nrunning);
 #endif
-        /* reset events */
-        for (s32 i = 0; i < pm->nrunning; ++i) evs[i] = 0;
-
-        ccm_proc_mgr_pub_ev(pm);
+        /* jobs that failed to fork are already posted, don't block on them */
+        if (pm->nready == 0) {
+            s64 span = ccm_trace_begin(&spec->trace);
+            ccm_proc_mgr_pub_ev(pm);
+            ccm_trace_end(&spec->trace, "ccm_proc_mgr_pub_ev", span);
+        }
 
-        for (s32 i = 0; i < pm->nrunning; ++i) {
+        for (s32 k = 0; k < pm->nready; ++k) {
+            s32 i = pm->ready[k];
             if (evs[i] & read_mask) {
-                ccm_childproc_read(&cps[i]);
-                if (evs[i] & POLLHUP) {
-                    if (close(cps[i].pipe.read) != 0) {
-                        ccm_log(CCM_LOG_ERROR, "close: child %d failed: %s\n",
-                                cps[i].pid, strerror(errno));
-                    }
+                if (cps[i].pipe.read >= 0) ccm_childproc_read(&cps[i]);
+                if ((evs[i] & CCM_EVENT_POLLHUP) && !(evs[i] & done_mask)) {
+                    /* all output is in, the pidfd still reports the exit */
+                    ccm_proc_mgr_close(pm, &cps[i].pipe.read);
                 }
             }
 
             if (evs[i] & done_mask) {
-                /* update the ready queue with targets in current target depedent list */
-                ccm_target_propagate_done(cps[i].target, &ready_queue);
-                double cptime = 1000 * (double)(clock() - cps[i].time)/CLOCKS_PER_SEC;
-                if (evs[i] & CCM_EVENT_WAIT_DONE) {
-                    ccm_log(CCM_LOG_INFO, "Target [%s], job [%d] time: %f ms\n",
-                            cps[i].target->name,
+                ccm_proc_mgr_close(pm, &cps[i].pipe.read);
+                ccm_proc_mgr_close(pm, &cps[i].pidfd);
+                ccm_jobserver_release(&pm->js, cps[i].token);
+                /* jobs that never ran a child (cache hits, failed spawns) end here */
+                if (cps[i].target->end_ns == 0) cps[i].target->end_ns = ccm_now_ns();
+                ccm_path_forget(&spec->paths, cps[i].target->name);
+                ccm_trace_job(&spec->trace, cps[i].target, i + 1, cps[i].cached ? 0 : cps[i].pid,
+                              WIFSIGNALED(cps[i].status) ? 128 + WTERMSIG(cps[i].status)
+                                                         : WEXITSTATUS(cps[i].status));
+                bool changed = true;
+                bool ok = (evs[i] & CCM_EVENT_WAIT_DONE) &&
+                    WEXITSTATUS(cps[i].status) == EXIT_SUCCESS;
+                if (ok) {
+                    /* a cache hit already logged the inputs from its manifest */
+                    bool deps_changed = cps[i].cached || (cps[i].depfile && spec->deplog.fd >= 0 &&
+                        ccm_deplog_ingest(&spec->deplog, cps[i].target->name, cps[i].depfile));
+                    if (cps[i].cache_key && !cps[i].cached) {
+                        ccm_cache_store(spec, cps[i].target, cps[i].cache_key);
+                    }
+                    if (spec->restat && spec->db.header) {
+                        changed = ccm_target_restat(spec, cps[i].target);
+                    }
+                    if (spec->db.header) {
+                        /* the inputs hash covers the discovered headers too */
+                        u64 inputs = deps_changed && ccm_spec_content_checks(spec)
+                            ? ccm_target_inputs_hash(spec, cps[i].target)
+                            : cps[i].inputs;
+                        ccm_target_record(spec, cps[i].target, inputs,
+                                          ccm_command_hash(cps[i].cmd),
+                                          cps[i].target->end_ns - cps[i].target->start_ns);
+                    }
+                }
+                ccm_target *t = cps[i].target;
+                if (cps[i].cached) {
+                    ccm_log(CCM_LOG_INFO, "Target [%s] restored from cache\n",
+                            cps[i].target->name);
+                    ccm_sep(80);
+                } else if (evs[i] & CCM_EVENT_WAIT_DONE) {
+                    ccm_log(CCM_LOG_INFO, "Target [%s], job [%d] time: %.3f ms "
+                            "(user %.3f ms, sys %.3f ms, maxrss %ld KiB)\n",
+                            t->name,
                             cps[i].pid,
-                            cptime);
+                            (t->end_ns - t->start_ns) / 1e6,
+                            t->utime_ns / 1e6,
+                            t->stime_ns / 1e6,
+                            t->maxrss_kb);
                     ccm_as_scratch_arena(spec->arena) {
                         ccm_log(CCM_LOG_INFO, "CMD: %s\n",
                                 ccm_concat(&spec->arena, cps[i].cmd));
                     }
                     ccm_childproc_report(&cps[i]);
                 }
-                ccm_swap(ccm_childproc, cps[i], cps[pm->nrunning - 1]);
-                ccm_swap(pollfd, pfds[i], pfds[pm->nrunning - 1]);
-                ccm_swap(ccm_event, evs[i], evs[pm->nrunning - 1]);
+                if (ok) {
+                    /* update the ready queue with targets in current target depedent list */
+                    remaining_targets -= ccm_target_propagate_done(spec, t, changed, ready_queue);
+                } else {
+                    remaining_targets -= ccm_proc_mgr_fail(pm, &cps[i]);
+                }
+                cps[i].target = NULL;
+                pm->free[pm->nfree++] = i;
                 --pm->nrunning;
+                pm->nslots -= ccm_proc_mgr_slots(pm, t);
+                pm->mem_kb -= t->mem_est_kb;
+                if (t->pool) --t->pool->nrunning;
                 --remaining_targets;
-                --i;
             }
-            /* TODO: handle error events with proper error messages */
+            evs[i] = 0;
         }
+        pm->nready = 0;
+    }
+    ready_queue->len = 0;
+
+    /* whatever did not finish stays active, a watch run retries it */
+    for (u32 i = 0; i < g->n; ++i) {
+        bool unfinished = (g->state[i] & CCM_NODE_ACTIVE) && !(g->state[i] & CCM_NODE_DONE);
+        pm->nskipped += unfinished;
+        g->state[i] = unfinished ? CCM_NODE_ACTIVE | (g->state[i] & (CCM_NODE_FAILED | CCM_NODE_INTERRUPTED)) : 0;
+    }
+    pm->nskipped -= pm->nfailed + pm->ninterrupted;
+    spec->failed = pm->nfailed + pm->ninterrupted;
+
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    if (pm->signal) {
+        ccm_log(CCM_LOG_ERROR, "interrupted by %s, %d jobs stopped\n",
+                strsignal(pm->signal), pm->ninterrupted);
     }
+    return pm->signal;
 }
 
 ccm_proc_mgr ccm_proc_mgr_init(ccm_spec *spec, s32 timeout)
 {
+    s32 j = spec->j > 0 ? spec->j : ccm_online_cpus();
     ccm_proc_mgr pm = {
-        .maxjobs  = spec->j,
+        .maxjobs  = j,
+        .limit    = j,
+        .adaptive = spec->j <= 0,
         .nrunning = 0,
         .timeout  = timeout,
-        .spec = spec,
-        .evs  = ccm_arena_alloc(ccm_event,     &spec->arena, spec->j),
-        .cps  = ccm_arena_alloc(ccm_childproc, &spec->arena, spec->j),
-        .pfds = ccm_arena_alloc(pollfd,        &spec->arena, spec->j),
+        .sigfd    = -1,
+        .intfd    = -1,
+        .nfree    = j,
+        .spec  = spec,
+        .free  = ccm_arena_alloc(s32,           &spec->arena, j),
+        .ready = ccm_arena_alloc(s32,           &spec->arena, j),
+        .evs   = ccm_arena_alloc(ccm_event,     &spec->arena, j),
+        .cps   = ccm_arena_alloc(ccm_childproc, &spec->arena, j),
     };
+    /* wake up to resample while jobs run long */
+    if (pm.adaptive && (timeout < 0 || timeout > CCM_ADAPT_INTERVAL_MS)) {
+        pm.timeout = CCM_ADAPT_INTERVAL_MS;
+    }
+
+    pm.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (pm.epfd < 0) {
+        ccm_panic("ccm_proc_mgr_init: epoll_create1 failed, %s\n", strerror(errno));
+    }
+
+    /* probe pidfd_open on ourselves, fall back to SIGCHLD otherwise */
+    s32 probe = syscall(SYS_pidfd_open, getpid(), 0);
+    if (probe >= 0) {
+        close(probe);
+    } else {
+        sigset_t chld;
+        sigemptyset(&chld);
+        sigaddset(&chld, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &chld, &pm.sigmask);
+        pm.sigfd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (pm.sigfd < 0) {
+            ccm_panic("ccm_proc_mgr_init: signalfd failed, %s\n", strerror(errno));
+        }
+        ccm_proc_mgr_watch(&pm, pm.sigfd, CCM_EPOLL_SIGCHLD);
+    }
+
+    /* a signal ignored by whoever started us (nohup, a background job) stays so */
+    sigemptyset(&pm.intmask);
+    s32 const stops[] = { SIGINT, SIGTERM, SIGHUP };
+    for (s32 i = 0; i < ccm_countof(stops); ++i) {
+        struct sigaction sa;
+        if (sigaction(stops[i], NULL, &sa) == 0 && sa.sa_handler != SIG_IGN) {
+            sigaddset(&pm.intmask, stops[i]);
+        }
+    }
+    pm.intfd = signalfd(-1, &pm.intmask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (pm.intfd < 0) {
+        ccm_panic("ccm_proc_mgr_init: signalfd failed, %s\n", strerror(errno));
+    }
+    ccm_proc_mgr_watch(&pm, pm.intfd, CCM_EPOLL_INTERRUPT);
+
+    pm.js = ccm_jobserver_init(pm.maxjobs, spec->jobserver);
+    if (pm.js.rfd >= 0) {
+        /* registered disarmed, ccm_proc_mgr_arm_jobserver toggles it */
+        struct epoll_event ev = { .events = 0, .data.u64 = CCM_EPOLL_JOBSERVER };
+        epoll_ctl(pm.epfd, EPOLL_CTL_ADD, pm.js.rfd, &ev);
+    }
 
     for (s32 i = 0; i < pm.maxjobs; ++i) {
-        ccm_da_init(&pm.cps[i].report, CCM_CHILDPROC_REPORT_BUF_CAP, CCM_ZERO_MEM);
+        /* slot 0 goes out first */
+        pm.free[i] = pm.maxjobs - 1 - i;
+        pm.evs[i]  = 0;
+        pm.cps[i]  = (ccm_childproc){ .pidfd = -1, .log = -1, .pipe = { -1, -1 } };
+        ccm_da_init(&pm.cps[i].report, CCM_CHILDPROC_REPORT_BUF_CAP, CCM_NOZERO_MEM);
     }
 
     return pm;
@@ -1105,17 +4970,25 @@ void ccm_proc_mgr_deinit(ccm_proc_mgr *pm)
      * cps are allocated from the arena, so we must free them first
      */
     for (s32 i = 0; i < pm->maxjobs; ++i) ccm_da_deinit(&pm->cps[i].report);
+
+    if (pm->sigfd >= 0) {
+        close(pm->sigfd);
+        sigprocmask(SIG_SETMASK, &pm->sigmask, NULL);
+    }
+    close(pm->intfd);
+    ccm_jobserver_deinit(&pm->js);
+    close(pm->epfd);
 }
 
 
 #ifndef CCM_BOOTSTRAP_FLAGS
 #define CCM_BOOTSTRAP_FLAGS                                     \
     "-Wall", "-Wextra", "-Werror", "-g0", "-O0", "-pipe",       \
-    "-fsanitize=undefined,address,bounds"
+    "-fsanitize=undefined,address,bounds", "-pthread"
 #endif /* CCM_BOOTSTRAP_FLAGS */
 
 #ifndef CCM_BOOTSTRAP_TIMEOUT
-#define CCM_BOOTSTRAP_TIMEOUT 100
+#define CCM_BOOTSTRAP_TIMEOUT -1
 #endif /* CCM_BOOTSTRAP_TIMEOUT */
 
 void ccm_bootstrap(s32 argc, c8 **argv)
@@ -1126,7 +4999,7 @@ void ccm_bootstrap(s32 argc, c8 **argv)
         .sources = ccm_str8_array("ccm.c"),
         .watch   = ccm_str8_array("ccm.h"),
     };
-    if (!ccm_target_needs_rebuild(&bootstrap)) {
+    if (!ccm_target_needs_rebuild(NULL, &bootstrap)) {
         ccm_log(CCM_LOG_INFO,
                 "Target [%s] upto date, skip rebuild\n",
                 bootstrap.name);
@@ -1151,14 +5024,18 @@ void ccm_bootstrap(s32 argc, c8 **argv)
 
     ccm_proc_mgr pm = ccm_proc_mgr_init(&spec, CCM_BOOTSTRAP_TIMEOUT);
     {
-        ccm_proc_mgr_run(&pm);
-        if (WEXITSTATUS(pm.cps[0].status) == EXIT_FAILURE) {
+        s32 sig = ccm_proc_mgr_run(&pm);
+        if (spec.failed > 0) {
             ccm_log(CCM_LOG_INFO, "bootstrap failed\n");
             rename(tmpname, bootstrap.name);
+            ccm_proc_mgr_deinit(&pm);
+            fflush(stdout);
+            if (sig) raise(sig);
             exit(EXIT_FAILURE);
         }
     }
     ccm_proc_mgr_deinit(&pm);
+    ccm_path_table_deinit(&spec.paths);
     ccm_arena_deinit(&spec.arena);
 
     ccm_log(CCM_LOG_INFO, "bootstrap succeeded\n");
@@ -1167,31 +5044,6 @@ void ccm_bootstrap(s32 argc, c8 **argv)
     exit(1);
 }
 
-void ccm_compute_dependents(ccm_spec *spec)
-{
-    for (s32 i = 0; i < spec->deps.len; ++i) {
-        ccm_target *t = spec->deps.items[i];
-        for (s32 j = 0; j < t->deps.len; ++j) {
-            ccm_target *dep = t->deps.items[j];
-            dep->revdeps.len += 1;
-        }
-    }
-
-    for (s32 i = 0; i < spec->deps.len; ++i) {
-        ccm_target *t = spec->deps.items[i];
-        t->revdeps.items = ccm_arena_alloc(ccm_target *, &spec->arena, t->revdeps.len);
-        t->revdeps.len = 0;
-    }
-
-    for (s32 i = 0; i < spec->deps.len; ++i) {
-        ccm_target *t = spec->deps.items[i];
-        for (s32 j = 0; j < t->deps.len; ++j) {
-            ccm_target *dep = t->deps.items[j];
-            dep->revdeps.items[dep->revdeps.len++] = t;
-        }
-    }
-}
-
 ccm_ring_buffer ccm_init_rb(ccm_arena *arena, lll cap)
 {
     ccm_ring_buffer ready_queue = {
@@ -1204,36 +5056,318 @@ ccm_ring_buffer ccm_init_rb(ccm_arena *arena, lll cap)
     return ready_queue;
 }
 
+/* epoll_wait timeout in ms, -1 sleeps until a child makes progress */
 #ifndef CCM_DEFAULT_TIMEOUT
-#define CCM_DEFAULT_TIMEOUT 100
+#define CCM_DEFAULT_TIMEOUT -1
 #endif
 
+void ccm_spec_open(ccm_spec *spec)
+{
+    spec->db = (ccm_db){ .fd = -1 };
+    /* command signatures, durations and content hashes live in the db, the
+     * cache takes headers from depfiles */
+    if (spec->db_path == NULL) spec->db_path = CCM_DB_DEFAULT_PATH;
+    if (spec->cache_dir) spec->depfiles = true;
+    if (spec->db_path[0] && !ccm_db_open(&spec->db, spec->db_path)) {
+        ccm_log(CCM_LOG_WARN, "build database unavailable, falling back to mtime checks\n");
+    }
+    spec->db.paths = &spec->paths;
+    spec->deplog = (ccm_deplog){ .fd = -1 };
+    if (spec->depfiles && !ccm_deplog_open(&spec->deplog, CCM_DEPLOG_DEFAULT_PATH, &spec->arena)) {
+        ccm_log(CCM_LOG_WARN, "dependency log unavailable, headers are not tracked\n");
+    }
+    spec->trace = (ccm_trace){ .on = spec->trace_path != NULL };
+    if (spec->manifest_path == NULL) spec->manifest_path = CCM_MANIFEST_DEFAULT_PATH;
+    spec->manifest = (ccm_manifest){ .path = spec->manifest_path[0] ? spec->manifest_path : NULL };
+    spec->cache = (ccm_cache){0};
+    if (spec->cache_dir && spec->db.header &&
+        !ccm_cache_open(&spec->cache, spec->cache_dir, spec->cache_max_bytes, spec->compiler)) {
+        ccm_log(CCM_LOG_WARN, "compilation cache %s unavailable\n", spec->cache_dir);
+        spec->cache = (ccm_cache){0};
+    }
+}
+
+void ccm_spec_close(ccm_spec *spec)
+{
+    if (spec->trace.events.items) ccm_da_deinit(&spec->trace.events);
+    if (spec->db.header) ccm_db_close(&spec->db);
+    if (spec->deplog.fd >= 0) ccm_deplog_close(&spec->deplog);
+    ccm_manifest_close(&spec->manifest);
+    ccm_path_table_deinit(&spec->paths);
+}
+
+/* end of run report, the counters start over for the next run */
+void ccm_spec_summary(ccm_spec *spec, ccm_proc_mgr const *pm)
+{
+    ccm_spec_report_costs(spec);
+    ccm_spec_report_critical_path(spec, pm->history);
+
+    if (spec->failed > 0) {
+        for (u32 i = 0; i < spec->graph.n; ++i) {
+            if (spec->graph.state[i] & CCM_NODE_FAILED) {
+                ccm_log(CCM_LOG_ERROR, "failed: %s\n", spec->deps.items[i]->name);
+            } else if (spec->graph.state[i] & CCM_NODE_INTERRUPTED) {
+                ccm_log(CCM_LOG_ERROR, "interrupted: %s\n", spec->deps.items[i]->name);
+            }
+        }
+        ccm_log(CCM_LOG_ERROR, "build failed: %d failed, %d interrupted, %d skipped\n",
+                pm->nfailed, pm->ninterrupted, pm->nskipped);
+    }
+
+    if (spec->cache.dir) {
+        ccm_log(CCM_LOG_INFO, "cache: %d hits, %d misses, %d stored\n",
+                spec->cache.hits, spec->cache.misses, spec->cache.stores);
+        if (spec->cache.stores > 0) ccm_cache_trim(&spec->cache);
+        spec->cache.hits = spec->cache.misses = spec->cache.stores = 0;
+    }
+    if (spec->trace_path) ccm_trace_write(&spec->trace, spec->trace_path);
+}
+
 void ccm_spec_build(ccm_spec *spec)
 {
+    ccm_arena_phase(&spec->arena, "targets");
+    ccm_spec_open(spec);
+    ccm_arena_phase(&spec->arena, "open");
+
     ccm_proc_mgr pm = ccm_proc_mgr_init(spec, CCM_DEFAULT_TIMEOUT);
+    s32 sig;
     {
         /* this is where the ready-queue is populated and consumed */
-        ccm_proc_mgr_run(&pm);
+        sig = ccm_proc_mgr_run(&pm);
     }
     ccm_proc_mgr_deinit(&pm);
+    ccm_arena_phase(&spec->arena, "run");
+
+    ccm_spec_summary(spec, &pm);
+    ccm_spec_close(spec);
 
 #ifdef CCM_STATS
     ccm_stats();
 #endif  /* CCM_STATS */
+
+    /* die of the interrupt like the jobs did, once the logs are out */
+    if (sig) {
+        fflush(stdout);
+        raise(sig);
+    }
 }
 
 void ccm_spec_clean(ccm_spec *b)
 {
-    for (s32 i = 1; i < b->deps.len; ++i) {
+    if (b->objects) ccm_spec_expand_objects(b);
+    if (b->select.len > 0) ccm_spec_select(b);
+    for (s32 i = 0; i < b->deps.len; ++i) {
         if (remove(b->deps.items[i]->name) == -1) {
             ccm_log(CCM_LOG_ERROR, "rm %s failed!\n", b->deps.items[i]->name);
             continue;
         }
-        b->deps.items[i]->visited = 0;
-        b->deps.items[i]->collected = 0;
     }
 }
 
+// -----------------------------------------------------------------------------
+// Watch Mode
+// -----------------------------------------------------------------------------
+/* hash of the real directory of `path` and its name, the directory gets an
+ * inotify watch when `wd` is not NULL */
+u64 ccm_watch_key(ccm_watcher *w, c8 const *path, s32 *wd)
+{
+    c8 dir[PATH_MAX];
+    c8 real[PATH_MAX];
+    c8 const *slash = strrchr(path, '/');
+    c8 const *name  = slash ? slash + 1 : path;
+
+    if (slash == NULL)       snprintf(dir, sizeof(dir), ".");
+    else if (slash == path)  snprintf(dir, sizeof(dir), "/");
+    else                     snprintf(dir, sizeof(dir), "%.*s", (s32)(slash - path), path);
+    if (realpath(dir, real) == NULL) return 0;
+
+    u64 dirkey = ccm_hash_str8(real, 0);
+    if (wd) {
+        *wd = inotify_add_watch(w->fd, real, CCM_WATCH_EVENTS);
+        if (*wd < 0) {
+            ccm_log(CCM_LOG_WARN, "watch: %s: %s\n", real, strerror(errno));
+        } else {
+            while (w->dirs.len <= *wd) ccm_da_append(&w->dirs, 0);
+            w->dirs.items[*wd] = dirkey;
+        }
+    }
+    u64 key = ccm_hash_combine(dirkey, ccm_hash_str8(name, 0));
+    return key == 0 ? 1 : key;
+}
+
+void ccm_watcher_add(ccm_watcher *w, c8 const *path, ccm_target *t)
+{
+    s32 wd;
+    u32 head = 0;
+    u64 key = ccm_watch_key(w, path, &wd);
+    /* outputs change under our own jobs, their producers are the ones to watch */
+    if (key == 0 || ccm_hmap_get(&w->outputs, key, &head)) return;
+
+    if (!ccm_hmap_get(&w->files, key, &head)) ++w->nfiles;
+    ccm_da_append(&w->nodes, ((ccm_watch_node){ .target = t, .next = head }));
+    ccm_hmap_put(&w->files, key, w->nodes.len);
+}
+
+/* (re)builds the input index, logged headers change from run to run */
+void ccm_watcher_index(ccm_watcher *w, ccm_spec *spec)
+{
+    ccm_hmap_deinit(&w->files);
+    w->nodes.len = 0;
+    w->nfiles = 0;
+
+    for (s32 i = 0; i < spec->deps.len; ++i) {
+        u64 key = ccm_watch_key(w, spec->deps.items[i]->name, NULL);
+        if (key) ccm_hmap_put(&w->outputs, key, i);
+    }
+
+    for (s32 i = 0; i < spec->deps.len; ++i) {
+        ccm_target *t = spec->deps.items[i];
+        for (s32 j = 0; j < t->sources.len; ++j) ccm_watcher_add(w, t->sources.items[j], t);
+        for (s32 j = 0; j < t->watch.len; ++j)   ccm_watcher_add(w, t->watch.items[j], t);
+
+        ccm_deplog_entry const *e = ccm_deplog_get(&spec->deplog, t->name);
+        for (lll j = 0; e && j < e->len; ++j) {
+            ccm_watcher_add(w, spec->deplog.paths.items[e->ids[j]], t);
+        }
+    }
+}
+
+/* marks `t` and everything depending on it active */
+void ccm_graph_activate(ccm_graph *g, ccm_arena *scratch, u32 id)
+{
+    if (g->state[id] & CCM_NODE_ACTIVE) return;
+    ccm_as_scratch_arena(*scratch) {
+        u32 *stack = ccm_arena_alloc(u32, scratch, g->n);
+        u32 len = 0;
+        g->state[id] |= CCM_NODE_ACTIVE;
+        stack[len++] = id;
+        while (len > 0) {
+            u32 i = stack[--len];
+            for (u32 e = g->rev_off[i]; e < g->rev_off[i + 1]; ++e) {
+                u32 r = g->rev_idx[e];
+                if (g->state[r] & CCM_NODE_ACTIVE) continue;
+                g->state[r] |= CCM_NODE_ACTIVE;
+                stack[len++] = r;
+            }
+        }
+    }
+}
+
+/* marks the targets reading the changed files, returns how many got dirty */
+s32 ccm_watcher_dispatch(ccm_watcher *w, ccm_spec *spec, c8 const *buf, lll len)
+{
+    ccm_graph *g = &spec->graph;
+    s32 ndirty = 0;
+    for (c8 const *p = buf; p < buf + len;) {
+        struct inotify_event const *ev = (struct inotify_event const *)p;
+        p += sizeof(*ev) + ev->len;
+
+        if (ev->mask & IN_Q_OVERFLOW) {
+            /* events were lost, anything may have changed */
+            for (u32 i = 0; i < g->n; ++i) {
+                ndirty += !(g->state[i] & CCM_NODE_DIRTY);
+                g->state[i] |= CCM_NODE_DIRTY | CCM_NODE_ACTIVE;
+            }
+            continue;
+        }
+        if (ev->len == 0 || ev->wd < 0 || ev->wd >= w->dirs.len) continue;
+
+        u32 node;
+        u64 key = ccm_hash_combine(w->dirs.items[ev->wd], ccm_hash_str8(ev->name, 0));
+        if (!ccm_hmap_get(&w->files, key == 0 ? 1 : key, &node)) continue;
+
+        for (; node; node = w->nodes.items[node - 1].next) {
+            ccm_target *t = w->nodes.items[node - 1].target;
+            if (g->state[t->id] & CCM_NODE_DIRTY) continue;
+            ccm_log(CCM_LOG_INFO, "watch: %s changed, rebuilding [%s]\n", ev->name, t->name);
+            g->state[t->id] |= CCM_NODE_DIRTY;
+            ccm_graph_activate(g, &spec->arena, t->id);
+            ++ndirty;
+        }
+    }
+    return ndirty;
+}
+
+void ccm_watcher_deinit(ccm_watcher *w)
+{
+    close(w->fd);
+    ccm_hmap_deinit(&w->files);
+    ccm_hmap_deinit(&w->outputs);
+    if (w->dirs.items)  ccm_da_deinit(&w->dirs);
+    if (w->nodes.items) ccm_da_deinit(&w->nodes);
+}
+
+void ccm_spec_watch(ccm_spec *spec)
+{
+    ccm_spec_open(spec);
+    ccm_proc_mgr pm = ccm_proc_mgr_init(spec, CCM_DEFAULT_TIMEOUT);
+
+    /* an interrupt while waiting comes through the signalfd of pm, one during
+     * a run comes back from it, either way we get to clean up */
+    sigset_t saved;
+    sigprocmask(SIG_BLOCK, &pm.intmask, &saved);
+
+    s32 sig = ccm_proc_mgr_run(&pm);
+    ccm_spec_summary(spec, &pm);
+
+    ccm_watcher w = { .fd = inotify_init1(IN_CLOEXEC) };
+    if (w.fd < 0) ccm_panic("watch: inotify_init1 failed, %s\n", strerror(errno));
+    ccm_watcher_index(&w, spec);
+
+    struct pollfd fds[2] = {
+        { .fd = w.fd,     .events = POLLIN },
+        { .fd = pm.intfd, .events = POLLIN },
+    };
+
+    _Alignas(struct inotify_event) c8 buf[64 * 1024];
+    while (sig == 0) {
+        ccm_log(CCM_LOG_INFO, "watch: %d files, waiting for changes\n", w.nfiles);
+
+        s32 ndirty = 0;
+        s64 changed_ns = 0;
+        while (ndirty == 0 && sig == 0) {
+            if (poll(fds, ccm_countof(fds), -1) < 0) {
+                if (errno == EINTR) continue;
+                ccm_panic("watch: poll failed, %s\n", strerror(errno));
+            }
+            if (fds[1].revents & POLLIN) {
+                struct signalfd_siginfo info;
+                if (read(pm.intfd, &info, sizeof(info)) == sizeof(info)) sig = info.ssi_signo;
+                continue;
+            }
+            if (!(fds[0].revents & POLLIN)) continue;
+            lll n = read(w.fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) ccm_panic("watch: read failed, %s\n", strerror(errno));
+            changed_ns = ccm_now_ns();
+            ndirty = ccm_watcher_dispatch(&w, spec, buf, n);
+        }
+        if (sig) break;
+
+        sig = ccm_proc_mgr_run_active(&pm);
+
+        s64 first_start = 0;
+        for (s32 i = 0; i < spec->deps.len; ++i) {
+            s64 start = spec->deps.items[i]->start_ns;
+            if (start && (first_start == 0 || start < first_start)) first_start = start;
+        }
+        if (first_start) {
+            ccm_log(CCM_LOG_INFO, "watch: change to first job start: %.3f ms\n",
+                    (first_start - changed_ns) / 1e6);
+        }
+        ccm_spec_summary(spec, &pm);
+        ccm_watcher_index(&w, spec);
+    }
+
+    ccm_log(CCM_LOG_INFO, "watch: stopped by %s\n", strsignal(sig));
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    ccm_watcher_deinit(&w);
+    ccm_proc_mgr_deinit(&pm);
+    ccm_spec_close(spec);
+    fflush(stdout);
+    raise(sig);
+}
+
 c8* ccm_shift_args(s32 *argc, c8 ***argv)
 {
     c8 *r = (*argv)[0];
@@ -6,7 +6,7 @@ typedef void (*build_callable)(ccm_spec *);
 
 void usage(c8 const* program)
 {
-    fprintf(stderr, "usage: %s <todo>\n", program);
+    fprintf(stderr, "usage: %s <build|clean|watch> [-k N] [target|pattern...]\n", program);
     exit(1);
 }
 
@@ -21,7 +21,7 @@ int main(s32 argc, c8 **argv)
                                       "-Wextra",
                                       "-g3",
                                       "-fsanitize=undefined,address,bounds"),
-        .j = 3,
+        .j = 0, /* one job per cpu, fewer while the machine is under pressure */
     };
 
     c8 *program = ccm_shift_args(&argc, &argv);
@@ -31,6 +31,25 @@ int main(s32 argc, c8 **argv)
     } else {
         if (strcmp(argv[0], "build") == 0) bb = ccm_spec_build;
         else if (strcmp(argv[0], "clean") == 0) bb = ccm_spec_clean;
+        else if (strcmp(argv[0], "watch") == 0) bb = ccm_spec_watch;
+        else usage(program);
+
+        /* the rest picks targets, e.g. `build ./bin/z-buffer` or `build 'bin/z-*'`,
+         * options may come anywhere among them */
+        s32 npicked = 0;
+        for (s32 i = 1; i < argc; ++i) {
+            if (strcmp(argv[i], "-k") == 0) {
+                /* -k N keeps going until N jobs failed, -k 0 never stops */
+                if (i + 1 == argc) usage(program);
+                s32 n = atoi(argv[++i]);
+                b.keep_going = n > 0 ? n : -1;
+            } else if (argv[i][0] == '-') {
+                usage(program);
+            } else {
+                argv[1 + npicked++] = argv[i];
+            }
+        }
+        b.select = (ccm_str8_array){ .len = npicked, .items = argv + 1 };
     }
 
     ccm_target hello = {
@@ -78,4 +97,5 @@ int main(s32 argc, c8 **argv)
     if (bb) bb(&b);
 
     ccm_arena_deinit(&b.arena);
+    return b.failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }